@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "config.h"
+
+_Atomic(struct config *) config_current = NULL;
+
+// bumped on every publish, readers copy it when they pass a quiescent state
+static atomic_ulong config_epoch = 1;
+
+// NOTE: the lists below are only touched when registering readers and publishing, never on the hot path
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct config_reader *config_readers = NULL;
+
+struct config_retired {
+    struct config *config;
+    unsigned long epoch;
+    struct config_retired *next;
+};
+static struct config_retired *config_retired_list = NULL;
+static atomic_uint config_retired_count = 0;
+
+static void config_set_defaults(struct config *config) {
+    config->port = 9050;
+    config->max_connection_count = 12;
+    config->accept_queue = 64;
+    config->queue_timeout = 1000;
+    config->fd_watermark = 90;
+    config->memory_watermark = 0;
+    config->handshake_timeout = 300;
+    config->message_timeout = 60000;
+    config->connect_timeout = 5000;
+    config->optimistic_reply = 0;
+    config->max_body_size = 64 << 20;
+    config->spill_threshold = 1 << 20;
+    config->sched_quantum = 64 << 10;
+    config->sched_time_budget = 2000;
+    config->client_rate = 0;
+    config->client_burst = 0;
+    config->dest_rate = 0;
+    config->dest_burst = 0;
+    config->negative_ttl = 2000;
+    config->breaker_threshold = 3;
+    config->breaker_backoff = 1000;
+    config->breaker_max_backoff = 60000;
+    config->intercept_requests = 1;
+    config->intercept_responses = 0;
+    config->intercept_host_count = 0;
+    config->intercept_hosts = NULL;
+    config->handoff_flows = 1;
+    config->handoff_timeout = 5000;
+    memcpy(config->editor, "/bin/nvim", sizeof("/bin/nvim"));
+    memcpy(config->log_file, "-", sizeof("-"));
+    memcpy(config->trace_file, "none", sizeof("none"));
+    config->trace_sample_rate = 100;
+    memcpy(config->tls_ca_cert, "none", sizeof("none"));
+    memcpy(config->tls_ca_key, "none", sizeof("none"));
+    config->tls_cert_cache = 1024;
+    config->tls_key_pool = 16;
+    config->tls_max_pumps = 64;
+    config->tls_verify = 1;
+}
+
+static char *config_trim(char *s) {
+    while (isspace((unsigned char)*s))
+        ++s;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        --end;
+    *end = 0;
+    return s;
+}
+
+static int config_parse_uint(const char *value, unsigned long max, unsigned long *out) {
+    char *end;
+    errno = 0;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (errno != 0 || *end != 0 || end == value || parsed > max)
+        return -1;
+    *out = parsed;
+    return 0;
+}
+
+static int config_set(struct config *config, const char *key, const char *value) {
+    unsigned long number;
+
+    if (strcmp(key, "port") == 0) {
+        if (config_parse_uint(value, 65535, &number) < 0 || number == 0)
+            return -1;
+        config->port = number;
+    } else if (strcmp(key, "max_connections") == 0) {
+        if (config_parse_uint(value, 65535, &number) < 0 || number == 0)
+            return -1;
+        config->max_connection_count = number;
+    } else if (strcmp(key, "accept_queue") == 0) {
+        if (config_parse_uint(value, 65535, &number) < 0)
+            return -1;
+        config->accept_queue = number;
+    } else if (strcmp(key, "queue_timeout") == 0) {
+        if (config_parse_uint(value, 3600000, &number) < 0)
+            return -1;
+        config->queue_timeout = number;
+    } else if (strcmp(key, "fd_watermark") == 0) {
+        if (config_parse_uint(value, 100, &number) < 0 || number == 0)
+            return -1;
+        config->fd_watermark = number;
+    } else if (strcmp(key, "memory_watermark") == 0) {
+        if (config_parse_uint(value, (unsigned long)-1, &number) < 0)
+            return -1;
+        config->memory_watermark = number;
+    } else if (strcmp(key, "handshake_timeout") == 0) {
+        if (config_parse_uint(value, 3600000, &number) < 0)
+            return -1;
+        config->handshake_timeout = number;
+    } else if (strcmp(key, "message_timeout") == 0) {
+        if (config_parse_uint(value, 3600000, &number) < 0)
+            return -1;
+        config->message_timeout = number;
+    } else if (strcmp(key, "connect_timeout") == 0) {
+        if (config_parse_uint(value, 3600000, &number) < 0)
+            return -1;
+        config->connect_timeout = number;
+    } else if (strcmp(key, "optimistic_reply") == 0) {
+        if (strcmp(value, "yes") == 0)
+            config->optimistic_reply = 1;
+        else if (strcmp(value, "no") == 0)
+            config->optimistic_reply = 0;
+        else
+            return -1;
+    } else if (strcmp(key, "negative_ttl") == 0) {
+        if (config_parse_uint(value, 3600000, &number) < 0)
+            return -1;
+        config->negative_ttl = number;
+    } else if (strcmp(key, "breaker_threshold") == 0) {
+        if (config_parse_uint(value, 65535, &number) < 0)
+            return -1;
+        config->breaker_threshold = number;
+    } else if (strcmp(key, "breaker_backoff") == 0) {
+        if (config_parse_uint(value, 3600000, &number) < 0)
+            return -1;
+        config->breaker_backoff = number;
+    } else if (strcmp(key, "breaker_max_backoff") == 0) {
+        if (config_parse_uint(value, 3600000, &number) < 0)
+            return -1;
+        config->breaker_max_backoff = number;
+    } else if (strcmp(key, "max_body_size") == 0) {
+        if (config_parse_uint(value, (unsigned long)-1, &number) < 0)
+            return -1;
+        config->max_body_size = number;
+    } else if (strcmp(key, "spill_threshold") == 0) {
+        if (config_parse_uint(value, (unsigned long)-1, &number) < 0)
+            return -1;
+        config->spill_threshold = number;
+    } else if (strcmp(key, "sched_quantum") == 0) {
+        if (config_parse_uint(value, 1 << 30, &number) < 0 || number == 0)
+            return -1;
+        config->sched_quantum = number;
+    } else if (strcmp(key, "sched_time_budget") == 0) {
+        if (config_parse_uint(value, 10000000, &number) < 0)
+            return -1;
+        config->sched_time_budget = number;
+    } else if (strcmp(key, "client_rate") == 0) {
+        if (config_parse_uint(value, (unsigned long)-1, &config->client_rate) < 0)
+            return -1;
+    } else if (strcmp(key, "client_burst") == 0) {
+        if (config_parse_uint(value, (unsigned long)-1, &config->client_burst) < 0)
+            return -1;
+    } else if (strcmp(key, "dest_rate") == 0) {
+        if (config_parse_uint(value, (unsigned long)-1, &config->dest_rate) < 0)
+            return -1;
+    } else if (strcmp(key, "dest_burst") == 0) {
+        if (config_parse_uint(value, (unsigned long)-1, &config->dest_burst) < 0)
+            return -1;
+    } else if (strcmp(key, "intercept") == 0) {
+        if (strcmp(value, "none") == 0) {
+            config->intercept_requests = 0;
+            config->intercept_responses = 0;
+        } else if (strcmp(value, "requests") == 0) {
+            config->intercept_requests = 1;
+            config->intercept_responses = 0;
+        } else if (strcmp(value, "responses") == 0) {
+            config->intercept_requests = 0;
+            config->intercept_responses = 1;
+        } else if (strcmp(value, "both") == 0) {
+            config->intercept_requests = 1;
+            config->intercept_responses = 1;
+        } else
+            return -1;
+    } else if (strcmp(key, "intercept_host") == 0) {
+        config->intercept_hosts = realloc(config->intercept_hosts, (config->intercept_host_count + 1) * CONFIG_MAX_VALUE_LENGTH);
+        memcpy(config->intercept_hosts[config->intercept_host_count], value, strlen(value) + 1);
+        ++config->intercept_host_count;
+    } else if (strcmp(key, "handoff_flows") == 0) {
+        if (strcmp(value, "yes") == 0)
+            config->handoff_flows = 1;
+        else if (strcmp(value, "no") == 0)
+            config->handoff_flows = 0;
+        else
+            return -1;
+    } else if (strcmp(key, "handoff_timeout") == 0) {
+        if (config_parse_uint(value, 3600000, &number) < 0)
+            return -1;
+        config->handoff_timeout = number;
+    } else if (strcmp(key, "editor") == 0) {
+        memcpy(config->editor, value, strlen(value) + 1);
+    } else if (strcmp(key, "log_file") == 0) {
+        memcpy(config->log_file, value, strlen(value) + 1);
+    } else if (strcmp(key, "trace_file") == 0) {
+        memcpy(config->trace_file, value, strlen(value) + 1);
+    } else if (strcmp(key, "trace_sample_rate") == 0) {
+        if (config_parse_uint(value, 1 << 30, &number) < 0)
+            return -1;
+        config->trace_sample_rate = number;
+    } else if (strcmp(key, "tls_ca_cert") == 0) {
+        memcpy(config->tls_ca_cert, value, strlen(value) + 1);
+    } else if (strcmp(key, "tls_ca_key") == 0) {
+        memcpy(config->tls_ca_key, value, strlen(value) + 1);
+    } else if (strcmp(key, "tls_cert_cache") == 0) {
+        if (config_parse_uint(value, 1 << 20, &number) < 0 || number == 0)
+            return -1;
+        config->tls_cert_cache = number;
+    } else if (strcmp(key, "tls_key_pool") == 0) {
+        if (config_parse_uint(value, 65536, &number) < 0)
+            return -1;
+        config->tls_key_pool = number;
+    } else if (strcmp(key, "tls_max_pumps") == 0) {
+        if (config_parse_uint(value, 65536, &number) < 0 || number == 0)
+            return -1;
+        config->tls_max_pumps = number;
+    } else if (strcmp(key, "tls_verify") == 0) {
+        if (strcmp(value, "yes") == 0)
+            config->tls_verify = 1;
+        else if (strcmp(value, "no") == 0)
+            config->tls_verify = 0;
+        else
+            return -1;
+    } else
+        return -1;
+
+    return 0;
+}
+
+// NOTE: returns NULL if the file exists but is invalid, a missing file yields the defaults
+struct config *config_load(const char *path) {
+    struct config *config = malloc(sizeof(struct config));
+    config_set_defaults(config);
+
+    FILE *stream = fopen(path, "r");
+    if (stream == NULL) {
+        if (errno == ENOENT)
+            return config;
+        perror("config fopen failed");
+        config_free(config);
+        return NULL;
+    }
+
+    char line[2 * CONFIG_MAX_VALUE_LENGTH];
+    unsigned int line_number = 0;
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        ++line_number;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = 0;
+
+        char *key = config_trim(line);
+        if (*key == 0)
+            continue;
+
+        char *separator = strchr(key, '=');
+        if (separator == NULL) {
+            fprintf(stderr, "%s:%u: expected key = value\n", path, line_number);
+            goto invalid;
+        }
+        *separator = 0;
+        char *value = config_trim(separator + 1);
+        key = config_trim(key);
+
+        if (strlen(value) >= CONFIG_MAX_VALUE_LENGTH || config_set(config, key, value) < 0) {
+            fprintf(stderr, "%s:%u: invalid setting '%s'\n", path, line_number, key);
+            goto invalid;
+        }
+    }
+
+    fclose(stream);
+
+    // a bucket has to hold at least a second worth of tokens
+    if (config->client_burst < config->client_rate)
+        config->client_burst = config->client_rate;
+    if (config->dest_burst < config->dest_rate)
+        config->dest_burst = config->dest_rate;
+    return config;
+
+    invalid:
+    fclose(stream);
+    config_free(config);
+    return NULL;
+}
+
+void config_free(struct config *config) {
+    free(config->intercept_hosts);
+    free(config);
+}
+
+char config_intercepts_host(const struct config *config, const char *host) {
+    if (config->intercept_host_count == 0)
+        return 1;
+
+    size_t host_length = strlen(host);
+    for (unsigned int i = 0; i < config->intercept_host_count; ++i) {
+        const char *pattern = config->intercept_hosts[i];
+        size_t pattern_length = strlen(pattern);
+        if (pattern_length > host_length)
+            continue;
+        // "example.com" matches itself and its subdomains
+        const char *suffix = host + host_length - pattern_length;
+        if (strcasecmp(suffix, pattern) == 0 && (suffix == host || suffix[-1] == '.'))
+            return 1;
+    }
+    return 0;
+}
+
+void config_publish(struct config *config) {
+    struct config *old = atomic_exchange(&config_current, config);
+    if (old == NULL)
+        return;
+
+    struct config_retired *retired = malloc(sizeof(struct config_retired));
+    retired->config = old;
+    retired->epoch = atomic_fetch_add(&config_epoch, 1) + 1;
+
+    pthread_mutex_lock(&config_lock);
+    retired->next = config_retired_list;
+    config_retired_list = retired;
+    atomic_fetch_add(&config_retired_count, 1);
+    pthread_mutex_unlock(&config_lock);
+
+    config_reclaim();
+}
+
+void config_register_reader(struct config_reader *reader) {
+    atomic_store(&reader->epoch, atomic_load(&config_epoch));
+    pthread_mutex_lock(&config_lock);
+    reader->next = config_readers;
+    config_readers = reader;
+    pthread_mutex_unlock(&config_lock);
+}
+
+void config_unregister_reader(struct config_reader *reader) {
+    pthread_mutex_lock(&config_lock);
+    for (struct config_reader **i = &config_readers; *i != NULL; i = &(*i)->next) {
+        if (*i == reader) {
+            *i = reader->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&config_lock);
+}
+
+// the reader holds no snapshot pointer at this point
+void config_quiescent(struct config_reader *reader) {
+    atomic_store(&reader->epoch, atomic_load(&config_epoch));
+}
+
+// frees the snapshots every registered reader has moved past
+void config_reclaim(void) {
+    if (atomic_load(&config_retired_count) == 0)
+        return;
+
+    pthread_mutex_lock(&config_lock);
+
+    unsigned long oldest = atomic_load(&config_epoch);
+    for (struct config_reader *reader = config_readers; reader != NULL; reader = reader->next) {
+        unsigned long epoch = atomic_load(&reader->epoch);
+        if (epoch < oldest)
+            oldest = epoch;
+    }
+
+    struct config_retired **i = &config_retired_list;
+    while (*i != NULL) {
+        struct config_retired *retired = *i;
+        if (retired->epoch <= oldest) {
+            *i = retired->next;
+            config_free(retired->config);
+            free(retired);
+            atomic_fetch_sub(&config_retired_count, 1);
+        } else
+            i = &retired->next;
+    }
+    pthread_mutex_unlock(&config_lock);
+}
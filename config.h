@@ -0,0 +1,91 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define CONFIG_DEFAULT_PATH "interceptor.conf"
+#define CONFIG_MAX_VALUE_LENGTH 256
+
+// NOTE: a published config is immutable, a reload builds a new snapshot and swaps the pointer
+struct config {
+    unsigned short port; // only read at startup
+    unsigned int max_connection_count;
+    // admission: clients beyond max_connection_count wait in a queue of accept_queue for up to queue_timeout ms,
+    // they are reset right away when it's full or when the fds (percent of the limit) or the resident memory
+    // (bytes, 0 for no limit) are above their watermark
+    unsigned int accept_queue;
+    int queue_timeout;
+    unsigned int fd_watermark;
+    size_t memory_watermark;
+    int handshake_timeout;
+    int message_timeout;
+    int connect_timeout;
+    char optimistic_reply; // reply to connect requests before the destination is connected
+    size_t max_body_size;
+    size_t spill_threshold; // messages above this are held in an mmapped temp file
+
+    // every side of a flow may relay sched_quantum bytes per round, for at most sched_time_budget us
+    size_t sched_quantum;
+    long sched_time_budget;
+    // bytes per second, 0 for no limit
+    unsigned long client_rate, client_burst;
+    unsigned long dest_rate, dest_burst;
+
+    // destinations that refused, were unreachable or timed out are answered from a cache for negative_ttl ms,
+    // breaker_threshold failures in a row keep them closed for a backoff doubling up to breaker_max_backoff ms
+    int negative_ttl;
+    unsigned int breaker_threshold; // 0 disables the breaker
+    int breaker_backoff;
+    int breaker_max_backoff;
+
+    char intercept_requests;
+    char intercept_responses;
+    // intercept only flows to these hosts (suffix match), everything when empty
+    unsigned int intercept_host_count;
+    char (*intercept_hosts)[CONFIG_MAX_VALUE_LENGTH];
+
+    // SIGUSR2 execs the binary again and hands it the listening socket
+    char handoff_flows; // also hand over live flows instead of draining them
+    int handoff_timeout;
+
+    char editor[CONFIG_MAX_VALUE_LENGTH];
+    char log_file[CONFIG_MAX_VALUE_LENGTH]; // "-" for stdout, only read at startup
+    char trace_file[CONFIG_MAX_VALUE_LENGTH]; // prefix of the chrome trace, "none" to disable, only read at startup
+    unsigned int trace_sample_rate; // one in this many flows is traced, 0 for none
+
+    // tls from clients to intercepted hosts is terminated with leaves signed by this ca, "none" to tunnel it.
+    // tls_cert_cache leaves and tls_key_pool pregenerated keys are kept, at most tls_max_pumps flows are
+    // terminated at once (a thread each). all of this is only read at startup
+    char tls_ca_cert[CONFIG_MAX_VALUE_LENGTH];
+    char tls_ca_key[CONFIG_MAX_VALUE_LENGTH];
+    unsigned int tls_cert_cache;
+    unsigned int tls_key_pool;
+    unsigned int tls_max_pumps;
+    char tls_verify; // check the destinations' certificates against the system store
+};
+
+// every thread reading the config registers one of these and reports quiescent states through it
+struct config_reader {
+    atomic_ulong epoch;
+    struct config_reader *next;
+};
+
+struct config *config_load(const char *path);
+void config_free(struct config *config);
+char config_intercepts_host(const struct config *config, const char *host);
+
+void config_publish(struct config *config);
+void config_register_reader(struct config_reader *reader);
+void config_unregister_reader(struct config_reader *reader);
+void config_quiescent(struct config_reader *reader);
+void config_reclaim(void);
+
+extern _Atomic(struct config *) config_current;
+
+// NOTE: the returned snapshot stays valid until the reader's next config_quiescent
+static inline const struct config *config_acquire(void) {
+    return atomic_load_explicit(&config_current, memory_order_acquire);
+}
+
+#endif // CONFIG_H
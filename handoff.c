@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "handoff.h"
+
+// starts argv[0] again with one end of a unix socket pair, returns the child's pid
+int handoff_spawn(char **argv, int *channel) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+        perror("socketpair failed");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        exit(1);
+    } else if (pid == 0) {
+        // nothing but the channel is inherited, everything else arrives over it. an inherited copy of a
+        // connection would keep it open after the old process closed it
+        if (dup2(pair[1], 3) == -1)
+            _exit(1);
+        close_range(4, ~0U, 0);
+        setenv(HANDOFF_ENV, "3", 1);
+        execvp(argv[0], argv);
+        perror("execvp failed");
+        _exit(1);
+    }
+
+    close(pair[1]);
+    *channel = pair[0];
+    return pid;
+}
+
+int handoff_send(int channel, struct handoff_message *message, const int *fds, unsigned int fd_count) {
+    message->version = HANDOFF_VERSION;
+    message->size = sizeof(struct handoff_message);
+
+    struct iovec iov = {.iov_base = message, .iov_len = sizeof(struct handoff_message)};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+
+    if (fd_count > 0) {
+        header.msg_control = control;
+        header.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+    }
+
+    while (sendmsg(channel, &header, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR)
+            return SOCKS_CONNECTION_TERMINATED;
+    }
+    return SOCKS_OK;
+}
+
+// NOTE: fds has to have room for two descriptors
+int handoff_recv(int channel, int timeout, struct handoff_message *message, int *fds, unsigned int *fd_count) {
+    struct pollfd pollfds[1] = {{.fd = channel, .events = POLLIN}};
+    int status = poll(pollfds, 1, timeout);
+    if (status == -1)
+        return errno == EINTR ? SOCKS_SYSTEM_INTERRUPT : SOCKS_CONNECTION_TERMINATED;
+    if (status == 0)
+        return SOCKS_TIMEOUT;
+
+    struct iovec iov = {.iov_base = message, .iov_len = sizeof(struct handoff_message)};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    // the stream keeps messages whole: every sendmsg is read by exactly one recvmsg with MSG_WAITALL
+    ssize_t received = recvmsg(channel, &header, MSG_WAITALL);
+    if (received != sizeof(struct handoff_message))
+        return SOCKS_CONNECTION_TERMINATED;
+
+    *fd_count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *fd_count * sizeof(int));
+        }
+    }
+
+    if (message->version != HANDOFF_VERSION || message->size != sizeof(struct handoff_message))
+        return SOCKS_INVALID_VERSION;
+    return SOCKS_OK;
+}
@@ -0,0 +1,49 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <netinet/in.h>
+
+#include "socks5.h"
+
+// the new process finds its end of the channel here
+#define HANDOFF_ENV "INTERCEPTOR_HANDOFF_FD"
+// bumped whenever struct handoff_message changes, both sides have to agree on it
+#define HANDOFF_VERSION 8
+
+enum handoff_message_types {
+    HANDOFF_LISTENER, // fds: listening socket
+    HANDOFF_FLOW, // fds: client, destination (udp relay socket for associations)
+    HANDOFF_DONE
+};
+
+// NOTE: sent as is over the channel, the descriptors travel alongside as SCM_RIGHTS
+struct handoff_message {
+    unsigned int version;
+    unsigned int size;
+    unsigned int type;
+
+    unsigned long flow_id; // HANDOFF_DONE: next flow id
+    struct sockaddr_in client_addr;
+    unsigned long bytes_in, bytes_out;
+    struct socks_request request;
+    // bodies that were being relayed in pieces continue where they stopped
+    struct socks_body_state body[2];
+    size_t message_length[2];
+    // requests waiting for their response, see struct flow
+    unsigned char transactions[SOCKS_PIPELINE_DEPTH];
+    unsigned int transaction_head, transaction_count;
+    unsigned char tls; // the fds are socketpairs to the tls pump threads of the old process
+    unsigned char closing; // see struct flow
+    size_t header_length[2]; // of a header that only partly arrived, its bytes follow the message
+    size_t pending_length[2]; // read but not sent on yet, follows the headers
+
+    // udp association state
+    struct in_addr udp_client_ip;
+    unsigned short udp_client_port;
+};
+
+int handoff_spawn(char **argv, int *channel);
+int handoff_send(int channel, struct handoff_message *message, const int *fds, unsigned int fd_count);
+int handoff_recv(int channel, int timeout, struct handoff_message *message, int *fds, unsigned int *fd_count);
+
+#endif // HANDOFF_H
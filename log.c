@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+#include "ring.h"
+#include "socks5.h"
+
+static FILE *log_stream = NULL;
+static struct ring_set log_set;
+
+static const char *log_event_names[] = {
+    [LOG_ESTABLISHED] = "established",
+    [LOG_ESTABLISH_FAILED] = "failed to establish connection",
+    [LOG_REJECTED] = "turned the client away",
+    [LOG_REQUEST] = "request",
+    [LOG_RESPONSE] = "response",
+    [LOG_SWITCHED] = "left http, relaying raw",
+    [LOG_TLS_INTERCEPTED] = "terminating tls",
+    [LOG_TLS_FAILED] = "tls interception failed",
+    [LOG_INVALID_MESSAGE] = "received invalid http message",
+    [LOG_SEND_FAILED] = "could not send an http message",
+    [LOG_EDITOR_FAILED] = "could not hand the message to the editor",
+    [LOG_UDP_FAILED] = "udp relay failed",
+    [LOG_CLOSED] = "closed connection",
+    [LOG_CLOSE_FAILED] = "close failed",
+    [LOG_IO_FAILED] = "connection failed",
+    [LOG_CONFIG_RELOADED] = "reloaded config",
+    [LOG_CONFIG_INVALID] = "invalid config, keeping the previous one",
+    [LOG_CONFIG_RESTART_REQUIRED] = "port change requires a restart",
+    [LOG_HANDOFF_SENT] = "handed off to the new process",
+    [LOG_HANDOFF_RECEIVED] = "took over from the old process",
+    [LOG_HANDOFF_FAILED] = "handoff failed, still serving"
+};
+
+void log_event(unsigned short event, int code, unsigned long flow_id, const struct sockaddr_in *client,
+        const struct sockaddr_in *dest, unsigned long bytes_in, unsigned long bytes_out) {
+    struct ring *ring;
+    struct log_record *record = ring_reserve(&log_set, &ring);
+    if (record == NULL)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &record->timestamp);
+    record->event = event;
+    record->code = code;
+    record->flow_id = flow_id;
+    if (client != NULL)
+        record->client = *client;
+    else
+        record->client.sin_family = AF_UNSPEC;
+    if (dest != NULL)
+        record->dest = *dest;
+    else
+        record->dest.sin_family = AF_UNSPEC;
+    record->bytes_in = bytes_in;
+    record->bytes_out = bytes_out;
+
+    ring_commit(ring);
+}
+
+static void log_format_address(const struct sockaddr_in *address, char *out, size_t length) {
+    if (address->sin_family != AF_INET) {
+        snprintf(out, length, "-");
+        return;
+    }
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address->sin_addr, ip, sizeof(ip));
+    snprintf(out, length, "%s:%u", ip, ntohs(address->sin_port));
+}
+
+static void log_format(const void *data) {
+    const struct log_record *record = data;
+    struct tm time;
+    char timestamp[32];
+    gmtime_r(&record->timestamp.tv_sec, &time);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &time);
+
+    char client[INET_ADDRSTRLEN + 8], dest[INET_ADDRSTRLEN + 8];
+    log_format_address(&record->client, client, sizeof(client));
+    log_format_address(&record->dest, dest, sizeof(dest));
+
+    fprintf(log_stream, "[log] %s.%06ldZ flow %lu %s -> %s %s", timestamp, record->timestamp.tv_nsec / 1000,
+            record->flow_id, client, dest, log_event_names[record->event]);
+
+    switch (record->event) {
+        case LOG_ESTABLISH_FAILED:
+        case LOG_REJECTED:
+        case LOG_INVALID_MESSAGE:
+        case LOG_SEND_FAILED:
+        case LOG_EDITOR_FAILED:
+        case LOG_UDP_FAILED:
+        case LOG_TLS_FAILED:
+        case LOG_HANDOFF_FAILED:
+            fprintf(log_stream, ": %s", socks_strerror(record->code));
+            break;
+        case LOG_CLOSE_FAILED:
+        case LOG_IO_FAILED:
+            fprintf(log_stream, ": %s", strerror(record->code));
+            break;
+        case LOG_REQUEST:
+        case LOG_RESPONSE:
+        case LOG_CLOSED:
+            fprintf(log_stream, " (in %lu, out %lu bytes)", record->bytes_in, record->bytes_out);
+            break;
+        case LOG_HANDOFF_SENT:
+        case LOG_HANDOFF_RECEIVED:
+            fprintf(log_stream, " (%lu flows)", record->bytes_in);
+            break;
+    }
+    fputc('\n', log_stream);
+}
+
+static void log_dropped(unsigned long count) {
+    fprintf(log_stream, "[log] dropped %lu records (ring full)\n", count);
+}
+
+// path "-" logs to stdout
+void log_start(const char *path) {
+    if (strcmp(path, "-") == 0)
+        log_stream = stdout;
+    else {
+        log_stream = fopen(path, "a");
+        if (log_stream == NULL) {
+            perror("log fopen failed");
+            exit(1);
+        }
+    }
+
+    // records are flushed in batches by the writer
+    setvbuf(log_stream, NULL, _IOFBF, 1 << 16);
+
+    log_set.record_size = sizeof(struct log_record);
+    log_set.ring_size = LOG_RING_SIZE;
+    log_set.flush_interval = LOG_FLUSH_INTERVAL;
+    log_set.stream = log_stream;
+    log_set.format = log_format;
+    log_set.dropped = log_dropped;
+    ring_start(&log_set);
+}
+
+void log_stop(void) {
+    ring_stop(&log_set);
+    if (log_stream != stdout)
+        fclose(log_stream);
+}
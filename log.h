@@ -0,0 +1,53 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+// records per thread, a power of two
+#define LOG_RING_SIZE 1024
+// how often the writer thread drains the rings (ms)
+#define LOG_FLUSH_INTERVAL 100
+
+enum log_events {
+    LOG_ESTABLISHED,
+    LOG_ESTABLISH_FAILED, // code: socks_error_codes
+    LOG_REJECTED, // code: socks_error_codes
+    LOG_REQUEST, // bytes_in: message length
+    LOG_RESPONSE, // bytes_out: message length
+    LOG_SWITCHED,
+    LOG_TLS_INTERCEPTED,
+    LOG_TLS_FAILED, // code: socks_error_codes
+    LOG_INVALID_MESSAGE, // code: socks_error_codes
+    LOG_SEND_FAILED, // code: socks_error_codes
+    LOG_EDITOR_FAILED, // code: socks_error_codes
+    LOG_UDP_FAILED, // code: socks_error_codes
+    LOG_CLOSED, // bytes_in/bytes_out: totals of the flow
+    LOG_CLOSE_FAILED, // code: errno
+    LOG_IO_FAILED, // code: errno
+    LOG_CONFIG_RELOADED,
+    LOG_CONFIG_INVALID,
+    LOG_CONFIG_RESTART_REQUIRED,
+    LOG_HANDOFF_SENT, // bytes_in: flows handed off
+    LOG_HANDOFF_RECEIVED, // bytes_in: flows taken over
+    LOG_HANDOFF_FAILED // code: socks_error_codes
+};
+
+// NOTE: fixed size so the hot path only copies it into the ring, formatting happens on the writer thread
+struct log_record {
+    struct timespec timestamp;
+    unsigned long flow_id;
+    struct sockaddr_in client;
+    struct sockaddr_in dest;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    int code;
+    unsigned short event;
+};
+
+void log_start(const char *path);
+void log_stop(void);
+void log_event(unsigned short event, int code, unsigned long flow_id, const struct sockaddr_in *client,
+        const struct sockaddr_in *dest, unsigned long bytes_in, unsigned long bytes_out);
+
+#endif // LOG_H
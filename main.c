@@ -1,33 +1,92 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
+#include "config.h"
+#include "handoff.h"
+#include "log.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "tls.h"
 #include "socks5.h"
+#include "socks5_udp.h"
+
+// clients accepted per loop iteration at most, so a connection storm can't starve the flows
+#define ACCEPT_BATCH 64
 
 // TODO: implement ipv6 support
 // TODO: replace short and longs with appropriate types
-// TODO: log clientnames
 // TODO: intercept only http traffic
 
 char interrupt_flag = 0;
+volatile sig_atomic_t reload_flag = 0;
+volatile sig_atomic_t upgrade_flag = 0;
+
+// what a response depends on from the request it answers
+enum flow_request_kinds {
+    FLOW_REQUEST_OTHER,
+    FLOW_REQUEST_HEAD, // the response has no body whatever its header says
+    FLOW_REQUEST_CONNECT, // switches to raw on 2xx
+    FLOW_REQUEST_UPGRADE // Upgrade header, switches to raw on 101
+};
+
+// per connection state, kept at the same index as the connection's pair in the poll array
+struct flow {
+    unsigned long id;
+    struct sockaddr_in client_addr;
+    unsigned long bytes_in, bytes_out; // from the client, from the destination
+    struct socks_request request;
+    struct socks_udp_association *udp; // NULL for tcp flows
+
+    // index 0 is the client side, 1 the destination side
+    struct socks_buffer header[2]; // header arriving in pieces, relayed once it's complete
+    struct timespec header_started[2]; // first bytes of the header arrived, it has message_timeout to complete
+    struct socks_body_state body[2]; // body still being relayed in pieces
+    // read from the side but not taken by the other one yet. the side isn't read from until it's all out,
+    // so a peer that stops reading only stalls its own flow
+    struct socks_buffer pending[2];
+    size_t pending_sent[2];
+    size_t message_length[2]; // of the message being relayed, for the log
+    long deficit[2]; // bytes the side may still relay in this round (deficit round robin)
+    struct timespec connect_started; // while request.pending
+    char traced; // sampled for the trace file
+    char tls; // the sockets carry the plaintext of tls sessions terminated by a pump thread
+    char closing; // a side ended while bytes were pending, the flow is closed once they are out
+
+    // requests still waiting for their response, in order (http/1.1 answers pipelined requests in order)
+    unsigned char transactions[SOCKS_PIPELINE_DEPTH];
+    unsigned int transaction_head, transaction_count;
+};
+
+// an accepted client waiting for a free slot
+struct pending_client {
+    int sockfd;
+    struct sockaddr_in addr;
+    struct timespec accepted;
+};
 
 void terminate_connection(int sockfd) {
-    if (close(sockfd) == -1) {
-        perror("close");
-        exit(1);
-    }
+    if (close(sockfd) == -1)
+        log_event(LOG_CLOSE_FAILED, errno, 0, NULL, NULL, 0, 0);
 }
 
-void remove_closed_sockets(struct pollfd *connections, unsigned int length) {
+void remove_closed_sockets(struct pollfd *connections, struct flow *flows, unsigned int length) {
     struct pollfd *copy = malloc(length * sizeof(struct pollfd));
     memcpy(copy, connections, length * sizeof(struct pollfd));
     unsigned int j = 0;
     for (unsigned int i = 0; i < length; ++i) {
         if (copy[i].fd != -1) {
             memcpy(&connections[j], &copy[i], sizeof(struct pollfd));
+            if (i % 2 == 0)
+                flows[j / 2] = flows[i / 2];
             ++j;
         }
     }
@@ -38,6 +97,42 @@ void set_interrupt_flag(int sig) {
     interrupt_flag = 1;
 }
 
+void set_reload_flag(int sig) {
+    reload_flag = 1;
+}
+
+void set_upgrade_flag(int sig) {
+    upgrade_flag = 1;
+}
+
+// reloads on SIGHUP or when the file changed, checked at most once a second
+void reload_config(const char *path, struct timespec *last_check, struct timespec *last_modified) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!reload_flag && now.tv_sec == last_check->tv_sec)
+        return;
+    *last_check = now;
+
+    struct stat file_stat;
+    char changed = stat(path, &file_stat) == 0
+        && (file_stat.st_mtim.tv_sec != last_modified->tv_sec || file_stat.st_mtim.tv_nsec != last_modified->tv_nsec);
+    if (!reload_flag && !changed)
+        return;
+    reload_flag = 0;
+    if (changed)
+        *last_modified = file_stat.st_mtim;
+
+    struct config *config = config_load(path);
+    if (config == NULL) {
+        log_event(LOG_CONFIG_INVALID, 0, 0, NULL, NULL, 0, 0);
+        return;
+    }
+    if (config->port != config_acquire()->port)
+        log_event(LOG_CONFIG_RESTART_REQUIRED, 0, 0, NULL, NULL, 0, 0);
+    config_publish(config);
+    log_event(LOG_CONFIG_RELOADED, 0, 0, NULL, NULL, 0, 0);
+}
+
 void debug_print(const char *s) {
     char c;
     for (c = *s; c != 0; c = *(++s)) {
@@ -50,180 +145,964 @@ void debug_print(const char *s) {
     }
 }
 
-void editor_modify_message(char *http_message, size_t length) {
-    const char *template = "/tmp/interceptor_request.XXXXXX";
-    char filename[64];
-    memcpy(filename, template, strlen(template) + 1);
-
-    int temp_file = mkstemp(filename);
-    if (temp_file == -1) {
-        perror("mkstemp failed");
-        exit(1);
-    }
+// hands the message to the editor through the buffer's temp file, whatever the editor saves becomes the message.
+// out of processes only this message fails (SOCKS_EDITOR_FAILED), the proxy keeps going
+int editor_modify_message(const char *editor, struct socks_buffer *http_message) {
+    int status;
+    if ((status = socks_buffer_spill(http_message)) < 0)
+        return status;
+    if ((status = socks_buffer_sync(http_message)) < 0)
+        return status;
 
     pid_t pid = fork();
 
-    if (pid == -1) {
-        perror("fork failed");
-        exit(1);
-    } else if (pid == 0) {
+    if (pid == -1)
+        return SOCKS_EDITOR_FAILED;
+    else if (pid == 0) {
         // TODO: check if the file was modified before opening it
-        execl("/bin/nvim", "nvim", "-c", "\":set fileformat=dos\"", filename, (char*)NULL); // TODO: set fileformat=dos
-    } else {
-        // write message into temp file
-        size_t written = 0;
-        while (written < length) {
-            ssize_t status = write(temp_file, http_message + written, length - written);
-            if (status == -1) {
-                if (status == EINTR)
-                    break;
-                perror("write failed");
-                exit(1);
-            }
-            written += status;
-        }
-
-        int status;
-        waitpid(pid, &status, 0);
-        if (!WIFEXITED(status)) {
-            fprintf(stderr, "child process terminated in an unexpected way\n");
-            exit(1);
+        execl(editor, editor, "-c", "\":set fileformat=dos\"", http_message->path, (char*)NULL); // TODO: set fileformat=dos
+        perror("execl failed");
+        _exit(1);
+    }
+
+    int wait_status;
+    while (waitpid(pid, &wait_status, 0) == -1) {
+        if (errno != EINTR)
+            return SOCKS_EDITOR_FAILED;
+    }
+    if (!WIFEXITED(wait_status))
+        fprintf(stderr, "child process terminated in an unexpected way\n");
+
+    // TODO: check/modify
+    return socks_buffer_remap(http_message);
+}
+
+long elapsed_us(const struct timespec *since, const struct timespec *now) {
+    return (now->tv_sec - since->tv_sec) * 1000000 + (now->tv_nsec - since->tv_nsec) / 1000;
+}
+
+// the client isn't read from while the response to its last request decides whether the connection stays http,
+// or while too many of its requests are outstanding
+char flow_paused(const struct flow *flow) {
+    if (flow->transaction_count == SOCKS_PIPELINE_DEPTH)
+        return 1;
+    if (flow->transaction_count == 0)
+        return 0;
+    unsigned char last = flow->transactions[(flow->transaction_head + flow->transaction_count - 1) % SOCKS_PIPELINE_DEPTH];
+    return last == FLOW_REQUEST_CONNECT || last == FLOW_REQUEST_UPGRADE;
+}
+
+void flow_account(struct flow *flow, unsigned int side, size_t n) {
+    flow->message_length[side] += n;
+    if (side == 0)
+        flow->bytes_in += n;
+    else
+        flow->bytes_out += n;
+}
+
+void flow_message_done(struct flow *flow, unsigned int side) {
+    if (side == 0)
+        log_event(LOG_REQUEST, 0, flow->id, &flow->client_addr, &flow->request.dest_addr, flow->message_length[side], 0);
+    else
+        log_event(LOG_RESPONSE, 0, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, flow->message_length[side]);
+}
+
+// takes what arrived of a header without waiting for the rest. once it's complete intercepts and forwards it (with
+// its body when intercepted) and pairs it with its request or response. what dest doesn't take right away is left
+// in the flow's pending bytes. returns the number of bytes sent
+ssize_t relay_http_header(const struct config *config, struct flow *flow, unsigned int side, int source, int dest) {
+    struct socks_buffer *header = &flow->header[side];
+    if (header->length == 0)
+        clock_gettime(CLOCK_MONOTONIC, &flow->header_started[side]);
+
+    struct trace_span span;
+    trace_begin(&span, side == 0 ? "read request header" : "read response header");
+    ssize_t content_length;
+    int status = socks_take_http_header(source, header, 0, &content_length);
+    trace_end(&span);
+    if (status == 0)
+        return 0;
+
+    // the flow starts over with the next header
+    struct socks_buffer http_message = *header;
+    socks_buffer_init(header, config->spill_threshold);
+    if (status > 0)
+        status = SOCKS_OK;
+
+    // NOTE: bytes behind the header are still in the socket, after a switch they are relayed raw
+    char switch_to_raw = 0;
+    if (status == SOCKS_OK && side == 0) {
+        unsigned char kind = FLOW_REQUEST_OTHER;
+        if (socks_http_is_method(http_message.data, http_message.length, "HEAD"))
+            kind = FLOW_REQUEST_HEAD;
+        else if (socks_http_is_method(http_message.data, http_message.length, "CONNECT"))
+            kind = FLOW_REQUEST_CONNECT;
+        else if (socks_http_has_header(http_message.data, http_message.length, "Upgrade"))
+            kind = FLOW_REQUEST_UPGRADE;
+        flow->transactions[(flow->transaction_head + flow->transaction_count++) % SOCKS_PIPELINE_DEPTH] = kind;
+    } else if (status == SOCKS_OK) {
+        // NOTE: a response nobody asked for is relayed as it frames itself
+        unsigned char kind = flow->transaction_count > 0 ? flow->transactions[flow->transaction_head] : FLOW_REQUEST_OTHER;
+        int code = socks_http_status(http_message.data, http_message.length);
+        if ((kind == FLOW_REQUEST_UPGRADE && code == 101) || (kind == FLOW_REQUEST_CONNECT && code / 100 == 2)) {
+            switch_to_raw = 1;
+            content_length = 0;
+        } else if (kind == FLOW_REQUEST_HEAD)
+            content_length = 0;
+        // other 1xx responses come before the final one
+        if ((code >= 200 || code == 101) && flow->transaction_count > 0) {
+            flow->transaction_head = (flow->transaction_head + 1) % SOCKS_PIPELINE_DEPTH;
+            --flow->transaction_count;
         }
+    }
 
-        // read and modify/check the file 
+    char intercept = side == 0 ? config->intercept_requests : config->intercept_responses;
+    if (status == SOCKS_OK && intercept && config_intercepts_host(config, flow->request.host)) {
+        trace_begin(&span, side == 0 ? "read request body" : "read response body");
+        status = socks_read_http_body(source, config->message_timeout, &http_message, content_length, config->max_body_size);
+        trace_end(&span);
+        content_length = 0;
 
-        FILE *stream = fdopen(temp_file, "r");
-        if (stream == NULL) {
-            perror("fdopen failed");
-            exit(1);
+        if (status == SOCKS_OK) {
+            trace_begin(&span, "editor");
+            status = editor_modify_message(config->editor, &http_message);
+            trace_end(&span);
+            // no process for the editor right now, the message goes out as it came in
+            if (status == SOCKS_EDITOR_FAILED) {
+                log_event(LOG_EDITOR_FAILED, status, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+                status = SOCKS_OK;
+            }
+            if (status < 0) {
+                socks_buffer_free(&http_message);
+                log_event(LOG_EDITOR_FAILED, status, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+                return status;
+            }
         }
+    }
+    if (status < 0) {
+        socks_buffer_free(&http_message);
+        if (status != SOCKS_CONNECTION_TERMINATED && status != SOCKS_SYSTEM_INTERRUPT)
+            log_event(LOG_INVALID_MESSAGE, status, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+        return status;
+    }
 
-        status = fseek(stream, 0, SEEK_END);
-        if (status == -1) {
-            perror("fseek failed");
-            exit(1);
+    trace_begin(&span, side == 0 ? "send request header" : "send response header");
+    size_t sent = 0;
+    ssize_t relayed = socks_send_http_message(dest, &http_message, &sent);
+    trace_end(&span);
+    if (relayed < 0) {
+        socks_buffer_free(&http_message);
+        log_event(LOG_SEND_FAILED, relayed, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+        return relayed;
+    }
+    size_t length = http_message.length;
+    if (sent < length) {
+        flow->pending[side] = http_message;
+        flow->pending_sent[side] = sent;
+    } else
+        socks_buffer_free(&http_message);
+
+    flow->message_length[side] = 0;
+    flow_account(flow, side, length);
+    socks_body_init(&flow->body[side], content_length);
+    if (flow->body[side].mode == SOCKS_BODY_NONE)
+        flow_message_done(flow, side);
+
+    if (switch_to_raw) {
+        flow->transaction_count = 0;
+        flow->body[0].mode = SOCKS_BODY_RAW;
+        flow->body[1].mode = SOCKS_BODY_RAW;
+        log_event(LOG_SWITCHED, 0, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+    }
+    return relayed;
+}
+
+// relays from one side of a flow for at most budget bytes and the configured time slice. headers are collected
+// across rounds and relayed whole, intercepted messages are read whole for the editor, other bodies are streamed
+// across rounds. messages pipelined behind each other are relayed in the same call while there is budget left.
+// stops once dest doesn't take more without blocking. returns the number of bytes sent
+ssize_t relay_http(const struct config *config, struct flow *flow, unsigned int side, int source, int dest, size_t budget) {
+    struct socks_body_state *body = &flow->body[side];
+    struct socks_buffer *pending = &flow->pending[side];
+    size_t relayed = 0;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (relayed < budget && pending->length == 0) {
+        if (body->mode == SOCKS_BODY_NONE) {
+            if (side == 0 && flow_paused(flow))
+                break;
+
+            ssize_t n = relay_http_header(config, flow, side, source, dest);
+            if (n <= 0) // an error, the rest of the header is yet to arrive or dest took none of it
+                return n < 0 ? n : relayed;
+            relayed += n;
         }
 
-        long file_size = ftell(stream);
-        if (file_size == -1) {
-            perror("ftell failed");
-            exit(1);
+        struct trace_span span = {.name = NULL};
+        if (body->mode != SOCKS_BODY_NONE)
+            trace_begin(&span, side == 0 ? "relay request body" : "relay response body");
+        while (body->mode != SOCKS_BODY_NONE && relayed < budget && pending->length == 0) {
+            ssize_t n = socks_relay_body(source, dest, body, budget - relayed, pending);
+            if (n == SOCKS_CONNECTION_TERMINATED && body->mode == SOCKS_BODY_UNTIL_CLOSE) {
+                // the body ended, and the flow with it
+                trace_end(&span);
+                flow_message_done(flow, side);
+                return n;
+            }
+            if (n < 0) {
+                trace_end(&span);
+                if (n != SOCKS_CONNECTION_TERMINATED && n != SOCKS_SYSTEM_INTERRUPT)
+                    log_event(LOG_INVALID_MESSAGE, n, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+                return n;
+            }
+            if (n == 0)
+                break;
+            // the part left pending is counted once it's out
+            relayed += n - pending->length;
+            flow_account(flow, side, n);
+            if (body->mode == SOCKS_BODY_NONE)
+                flow_message_done(flow, side);
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (elapsed_us(&start, &now) > config->sched_time_budget)
+                break;
         }
+        trace_end(&span);
 
-        status = fseek(stream, 0, SEEK_SET);
-        if (status == -1) {
-            perror("fseek failed");
-            exit(1);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (body->mode != SOCKS_BODY_NONE || elapsed_us(&start, &now) > config->sched_time_budget)
+            break;
+    }
+    return relayed;
+}
+
+// sends what the other side of a flow left pending to side, as much as its socket takes without blocking.
+// returns the number of bytes sent
+ssize_t flush_pending(struct flow *flow, unsigned int side, int sockfd) {
+    unsigned int other = 1 - side;
+    ssize_t sent = socks_send_http_message(sockfd, &flow->pending[other], &flow->pending_sent[other]);
+    if (sent < 0)
+        return sent;
+    if (flow->pending_sent[other] == flow->pending[other].length) {
+        socks_buffer_free(&flow->pending[other]);
+        flow->pending_sent[other] = 0;
+    }
+    return sent;
+}
+
+// frees what a flow buffers between rounds
+void free_flow_buffers(struct flow *flow) {
+    for (unsigned int side = 0; side < 2; ++side) {
+        socks_buffer_free(&flow->header[side]);
+        socks_buffer_free(&flow->pending[side]);
+    }
+}
+
+// looks at the client's first byte before its first message. tls to an intercepted host is terminated by a pump
+// thread and the flow carries on with the plaintext from then on, other tls is tunnelled as is
+int detect_tls(const struct config *config, struct flow *flow, struct pollfd *client, struct pollfd *dest) {
+    unsigned char c;
+    if (recv(client->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 1 || c != 0x16) // a handshake record
+        return SOCKS_OK;
+
+    if (!tls_enabled() || !config_intercepts_host(config, flow->request.host)) {
+        flow->body[0].mode = SOCKS_BODY_RAW;
+        flow->body[1].mode = SOCKS_BODY_RAW;
+        log_event(LOG_SWITCHED, 0, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+        return SOCKS_OK;
+    }
+
+    struct tls_flow_info info = {
+        .flow_id = flow->id, .traced = flow->traced, .client_addr = flow->client_addr,
+        .dest_addr = flow->request.dest_addr, .host = flow->request.host, .timeout = config->message_timeout
+    };
+    int plain[2];
+    int status = tls_intercept(client->fd, dest->fd, &info, plain);
+    if (status < 0) {
+        log_event(LOG_TLS_FAILED, status, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+        return status;
+    }
+    client->fd = plain[0];
+    dest->fd = plain[1];
+    flow->tls = 1;
+    log_event(LOG_TLS_INTERCEPTED, 0, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+    return SOCKS_OK;
+}
+
+// tokens the flow may spend right now (both its client and its destination limit apply),
+// sets *wait to the milliseconds until it's worth polling the flow again when there are none
+size_t available_tokens(const struct config *config, struct rate_limiter *client_limiter, struct rate_limiter *dest_limiter,
+        const struct flow *flow, const struct timespec *now, int *wait) {
+    double available = (size_t)-1 >> 1;
+    *wait = 0;
+
+    struct { struct rate_limiter *limiter; struct in_addr addr; unsigned long rate, burst; } limits[2] = {
+        {client_limiter, flow->client_addr.sin_addr, config->client_rate, config->client_burst},
+        {dest_limiter, flow->request.dest_addr.sin_addr, config->dest_rate, config->dest_burst}
+    };
+    for (unsigned int i = 0; i < 2; ++i) {
+        if (limits[i].rate == 0)
+            continue;
+        struct token_bucket *bucket = rate_limiter_bucket(limits[i].limiter, limits[i].addr, now, limits[i].rate, limits[i].burst);
+        if (bucket->tokens < available)
+            available = bucket->tokens;
+
+        // don't wake up for a handful of bytes
+        size_t wanted = limits[i].burst < 4096 ? limits[i].burst : 4096;
+        int bucket_wait = token_bucket_wait(bucket, limits[i].rate, wanted);
+        if (bucket_wait > *wait)
+            *wait = bucket_wait;
+    }
+    return available > 0 ? available : 0;
+}
+
+void spend_tokens(const struct config *config, struct rate_limiter *client_limiter, struct rate_limiter *dest_limiter,
+        const struct flow *flow, const struct timespec *now, size_t n) {
+    if (config->client_rate != 0)
+        rate_limiter_bucket(client_limiter, flow->client_addr.sin_addr, now, config->client_rate, config->client_burst)->tokens -= n;
+    if (config->dest_rate != 0)
+        rate_limiter_bucket(dest_limiter, flow->request.dest_addr.sin_addr, now, config->dest_rate, config->dest_burst)->tokens -= n;
+}
+
+// closes both sockets of a flow, a lookup that is still running closes its descriptor itself
+void terminate_flow(struct flow *flow, struct pollfd *pair) {
+    terminate_connection(pair[0].fd);
+    if (flow->request.pending == SOCKS_PENDING_RESOLVE)
+        socks_resolve_cancel(&flow->request);
+    else
+        terminate_connection(pair[1].fd);
+    pair[0].fd = -1;
+    pair[1].fd = -1;
+}
+
+// finishes the lookup and connect of a flow that got an optimistic reply, pair points at its client and destination.
+// each of them has connect_timeout. returns 1 once connected, 0 while still in flight and an error after closing the flow
+int finish_pending_connection(const struct config *config, struct socks_breaker *breaker, struct flow *flow,
+        struct pollfd *pair, const struct timespec *now) {
+    char timed_out = elapsed_us(&flow->connect_started, now) / 1000 >= config->connect_timeout;
+    if (flow->request.pending == SOCKS_PENDING_RESOLVE) {
+        if (!(pair[1].revents & POLLIN) && !timed_out)
+            return 0;
+        struct trace_span span = {.name = flow->traced ? "resolve" : NULL, .flow_id = flow->id, .start = flow->connect_started};
+        trace_end(&span);
+
+        // the lookup's descriptor is gone after this, the connecting socket takes its place
+        int sockfd = socks_resolve_finish(timed_out, breaker, &flow->request);
+        if (sockfd < 0) {
+            log_event(LOG_ESTABLISH_FAILED, sockfd, flow->id, &flow->client_addr, NULL, 0, 0);
+            terminate_connection(pair[0].fd);
+            pair[0].fd = -1;
+            pair[1].fd = -1;
+            return sockfd;
         }
+        pair[1].fd = sockfd;
+        clock_gettime(CLOCK_MONOTONIC, &flow->connect_started);
+        return 0;
+    }
+    if (!(pair[1].revents & (POLLOUT | POLLERR | POLLHUP)) && !timed_out)
+        return 0;
+
+    // the connect began in an earlier iteration, the span is filled in by hand
+    struct trace_span span = {.name = flow->traced ? "connect" : NULL, .flow_id = flow->id, .start = flow->connect_started};
+    trace_end(&span);
+
+    int status = socks_complete_connection(pair[1].fd, timed_out, breaker, &flow->request);
+    if (status < 0) {
+        log_event(LOG_ESTABLISH_FAILED, status, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+        terminate_flow(flow, pair);
+        return status;
+    }
+    log_event(LOG_ESTABLISHED, 0, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+    return 1;
+}
 
-        // TODO: check/modify
-        http_message = realloc(http_message, file_size + 1);
-        http_message[file_size] = 0;
-        size_t read = fread(http_message, 1, file_size, stream);
-        if (read < file_size) {
-            fprintf(stderr, "fread failed with an unknown error\n");
+// resets the client, it's not worth a reply or a TIME_WAIT entry when we are overloaded
+void reject_client(int sockfd, const struct sockaddr_in *addr, int reason) {
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    terminate_connection(sockfd);
+    log_event(LOG_REJECTED, reason, 0, addr, NULL, 0, 0);
+}
+
+// resident memory in bytes, read again at most every 100ms
+size_t resident_memory(const struct timespec *now) {
+    static size_t resident = 0;
+    static struct timespec last_read = {0};
+    if (last_read.tv_sec != 0 && elapsed_us(&last_read, now) < 100000)
+        return resident;
+    last_read = *now;
+
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return resident;
+    unsigned long pages;
+    if (fscanf(statm, "%*u %lu", &pages) == 1)
+        resident = pages * sysconf(_SC_PAGESIZE);
+    fclose(statm);
+    return resident;
+}
+
+// SOCKS_OK when a new client may take up resources
+int admission_check(const struct config *config, int client_sockfd, rlim_t fd_limit, const struct timespec *now) {
+    // the kernel hands out the lowest free descriptor, so everything below the client's is in use.
+    // its flow needs one more for the destination. the socketpairs of the tls pumps come and go on their
+    // own threads and can sit above it, their two descriptors each are counted on top
+    if ((rlim_t)client_sockfd + 2 + 2 * tls_active() > fd_limit * config->fd_watermark / 100)
+        return SOCKS_OVERLOADED;
+    if (config->memory_watermark != 0 && resident_memory(now) > config->memory_watermark)
+        return SOCKS_OVERLOADED;
+    return SOCKS_OK;
+}
+
+// handshakes with the client and adds its flow
+void start_flow(const struct config *config, struct socks_breaker *breaker, const struct pending_client *client,
+        struct pollfd *connections, struct flow *flows, unsigned int *connection_count, unsigned long *next_flow_id) {
+    struct flow *flow = &flows[*connection_count];
+    memset(flow, 0, sizeof(struct flow));
+    for (unsigned int side = 0; side < 2; ++side) {
+        socks_buffer_init(&flow->header[side], config->spill_threshold);
+        socks_buffer_init(&flow->pending[side], config->spill_threshold);
+    }
+    flow->id = (*next_flow_id)++;
+    flow->client_addr = client->addr;
+    flow->traced = trace_sample(flow->id, config->trace_sample_rate);
+    trace_flow(flow->id, flow->traced);
+
+    struct trace_span span;
+    struct addrinfo addrinfo;
+    trace_begin(&span, "handshake");
+    int dest_sockfd = socks_establish_connection(client->sockfd, config->handshake_timeout, config->connect_timeout,
+            config->optimistic_reply, breaker, &addrinfo, &flow->request);
+    trace_end(&span);
+    if (dest_sockfd < 0) {
+        log_event(LOG_ESTABLISH_FAILED, dest_sockfd, flow->id, &flow->client_addr, NULL, 0, 0);
+        terminate_connection(client->sockfd);
+        return;
+    }
+
+    if (flow->request.command == SOCKS_UDP_ASSOCIATE)
+        flow->udp = socks_udp_associate(dest_sockfd, client->sockfd, &flow->request);
+    connections[*connection_count * 2] = (struct pollfd){.fd = client->sockfd, .events = POLLIN | POLLHUP, .revents = 0};
+    connections[*connection_count * 2 + 1] = (struct pollfd){.fd = dest_sockfd, .events = POLLIN | POLLHUP, .revents = 0};
+    ++*connection_count;
+    if (flow->request.pending)
+        clock_gettime(CLOCK_MONOTONIC, &flow->connect_started);
+    else
+        log_event(LOG_ESTABLISHED, 0, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+}
+
+// passes the listening socket, and the flows if configured, to a freshly exec'd binary.
+// returns 1 once the new process confirmed it's serving, the caller then stops accepting
+char handoff_to_new_process(char **argv, const struct config *config, int host_sockfd,
+        struct pollfd *connections, struct flow *flows, unsigned int connection_count, unsigned long next_flow_id) {
+    int channel;
+    pid_t pid = handoff_spawn(argv, &channel);
+
+    struct handoff_message message;
+    memset(&message, 0, sizeof(message));
+    message.type = HANDOFF_LISTENER;
+    int status = handoff_send(channel, &message, &host_sockfd, 1);
+
+    for (unsigned int i = 0; status == SOCKS_OK && config->handoff_flows && i < connection_count; ++i) {
+        struct flow *flow = &flows[i];
+        memset(&message, 0, sizeof(message));
+        message.type = HANDOFF_FLOW;
+        message.flow_id = flow->id;
+        message.client_addr = flow->client_addr;
+        message.bytes_in = flow->bytes_in;
+        message.bytes_out = flow->bytes_out;
+        message.request = flow->request;
+        memcpy(message.body, flow->body, sizeof(message.body));
+        memcpy(message.message_length, flow->message_length, sizeof(message.message_length));
+        memcpy(message.transactions, flow->transactions, sizeof(message.transactions));
+        message.transaction_head = flow->transaction_head;
+        message.transaction_count = flow->transaction_count;
+        message.tls = flow->tls;
+        message.closing = flow->closing;
+        for (unsigned int side = 0; side < 2; ++side) {
+            message.header_length[side] = flow->header[side].length;
+            message.pending_length[side] = flow->pending[side].length - flow->pending_sent[side];
+        }
+        if (flow->udp != NULL) {
+            message.bytes_in = flow->udp->bytes_in;
+            message.bytes_out = flow->udp->bytes_out;
+            message.udp_client_ip = flow->udp->client_ip;
+            message.udp_client_port = flow->udp->client_port;
+        }
+        int fds[2] = {connections[i * 2].fd, connections[i * 2 + 1].fd};
+        status = handoff_send(channel, &message, fds, 2);
+        // what already arrived of a header follows the message, then what is still to be sent on
+        for (unsigned int side = 0; status == SOCKS_OK && side < 2; ++side) {
+            if (flow->header[side].length > 0 && sendn(channel, flow->header[side].data, flow->header[side].length, MSG_NOSIGNAL) < 0)
+                status = SOCKS_CONNECTION_TERMINATED;
+        }
+        for (unsigned int side = 0; status == SOCKS_OK && side < 2; ++side) {
+            if (message.pending_length[side] > 0 && sendn(channel, flow->pending[side].data + flow->pending_sent[side],
+                    message.pending_length[side], MSG_NOSIGNAL) < 0)
+                status = SOCKS_CONNECTION_TERMINATED;
+        }
+    }
+
+    if (status == SOCKS_OK) {
+        memset(&message, 0, sizeof(message));
+        message.type = HANDOFF_DONE;
+        message.flow_id = next_flow_id;
+        status = handoff_send(channel, &message, NULL, 0);
+    }
+
+    char ack = 0;
+    if (status == SOCKS_OK)
+        status = recvn(channel, &ack, 1, config->handoff_timeout, 0, 0);
+    close(channel);
+
+    if (status < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        log_event(LOG_HANDOFF_FAILED, status, 0, NULL, NULL, 0, 0);
+        return 0;
+    }
+    log_event(LOG_HANDOFF_SENT, 0, 0, NULL, NULL, connection_count, 0);
+    return 1;
+}
+
+// takes over the listening socket and flows of the process that exec'd this one
+void receive_handoff(int channel, const struct config *config, int *host_sockfd, struct pollfd **connections,
+        struct flow **flows, unsigned int *capacity, unsigned int *connection_count, unsigned long *next_flow_id) {
+    struct handoff_message message;
+    int fds[2];
+    unsigned int fd_count;
+    do {
+        int status = handoff_recv(channel, config->handoff_timeout, &message, fds, &fd_count);
+        if (status < 0) {
+            fprintf(stderr, "handoff failed: %s\n", socks_strerror(status));
             exit(1);
         }
 
-        if (fclose(stream) == EOF) {
-            perror("fclose failed");
+        if (message.type == HANDOFF_LISTENER && fd_count == 1) {
+            *host_sockfd = fds[0];
+        } else if (message.type == HANDOFF_FLOW && fd_count == 2) {
+            if (*connection_count == *capacity) {
+                *capacity *= 2;
+                *connections = realloc(*connections, (*capacity * 2 + 1) * sizeof(struct pollfd));
+                *flows = realloc(*flows, *capacity * sizeof(struct flow));
+            }
+
+            struct flow *flow = &(*flows)[*connection_count];
+            memset(flow, 0, sizeof(struct flow));
+            flow->id = message.flow_id;
+            flow->client_addr = message.client_addr;
+            flow->bytes_in = message.bytes_in;
+            flow->bytes_out = message.bytes_out;
+            flow->request = message.request;
+            memcpy(flow->body, message.body, sizeof(flow->body));
+            memcpy(flow->message_length, message.message_length, sizeof(flow->message_length));
+            memcpy(flow->transactions, message.transactions, sizeof(flow->transactions));
+            flow->transaction_head = message.transaction_head;
+            flow->transaction_count = message.transaction_count;
+            flow->tls = message.tls;
+            flow->closing = message.closing;
+            // a connect still in flight gets a fresh timeout, so does a partial header
+            clock_gettime(CLOCK_MONOTONIC, &flow->connect_started);
+            for (unsigned int side = 0; side < 2; ++side) {
+                socks_buffer_init(&flow->header[side], config->spill_threshold);
+                socks_buffer_init(&flow->pending[side], config->spill_threshold);
+                flow->header_started[side] = flow->connect_started;
+            }
+            struct { struct socks_buffer *buffer; size_t length; } carried[4] = {
+                {&flow->header[0], message.header_length[0]}, {&flow->header[1], message.header_length[1]},
+                {&flow->pending[0], message.pending_length[0]}, {&flow->pending[1], message.pending_length[1]}
+            };
+            for (unsigned int k = 0; k < 4; ++k) {
+                if (carried[k].length == 0)
+                    continue;
+                char *data = socks_buffer_reserve(carried[k].buffer, carried[k].length);
+                if (data == NULL || recvn(channel, data, carried[k].length, config->handoff_timeout, 0, 0) < 0) {
+                    fprintf(stderr, "handoff failed: buffered bytes lost\n");
+                    exit(1);
+                }
+                socks_buffer_commit(carried[k].buffer, carried[k].length);
+            }
+            // the old process's lookup can't be carried over, it's started again
+            if (flow->request.pending == SOCKS_PENDING_RESOLVE) {
+                close(fds[1]);
+                fds[1] = socks_resolve_start(&flow->request);
+                if (fds[1] < 0) {
+                    terminate_connection(fds[0]);
+                    free_flow_buffers(flow);
+                    continue;
+                }
+            }
+            flow->traced = trace_sample(flow->id, config->trace_sample_rate);
+            if (flow->request.command == SOCKS_UDP_ASSOCIATE) {
+                flow->udp = socks_udp_associate(fds[1], fds[0], &flow->request);
+                flow->udp->client_ip = message.udp_client_ip;
+                flow->udp->client_port = message.udp_client_port;
+                flow->udp->bytes_in = message.bytes_in;
+                flow->udp->bytes_out = message.bytes_out;
+            }
+            (*connections)[*connection_count * 2] = (struct pollfd){.fd = fds[0], .events = POLLIN | POLLHUP, .revents = 0};
+            (*connections)[*connection_count * 2 + 1] = (struct pollfd){.fd = fds[1], .events = POLLIN | POLLHUP, .revents = 0};
+            ++*connection_count;
+        } else if (message.type == HANDOFF_DONE) {
+            *next_flow_id = message.flow_id;
+        } else {
+            fprintf(stderr, "handoff failed: unexpected message\n");
             exit(1);
         }
+    } while (message.type != HANDOFF_DONE);
+
+    if (*host_sockfd == -1) {
+        fprintf(stderr, "handoff failed: no listening socket\n");
+        exit(1);
     }
+
+    char ack = 1;
+    if (sendn(channel, &ack, 1, MSG_NOSIGNAL) < 0)
+        exit(1);
+    close(channel);
+    log_event(LOG_HANDOFF_RECEIVED, 0, 0, NULL, NULL, *connection_count, 0);
 }
 
-int main() {
+int main(int argc, char **argv) {
     signal(SIGINT, set_interrupt_flag);
+    signal(SIGHUP, set_reload_flag);
+    signal(SIGUSR2, set_upgrade_flag);
+    // a peer that went away shows up as EPIPE from send instead
+    signal(SIGPIPE, SIG_IGN);
 
-    const unsigned int max_connection_count = 12;
-    int host_sockfd = socks_listen(9050, max_connection_count);
-    struct pollfd connections[max_connection_count * 2];
+    const char *config_path = argc > 1 ? argv[1] : CONFIG_DEFAULT_PATH;
+    struct config *initial_config = config_load(config_path);
+    if (initial_config == NULL)
+        exit(1);
+    config_publish(initial_config);
+
+    struct config_reader config_reader;
+    config_register_reader(&config_reader);
+
+    struct timespec last_reload_check = {0}, config_modified = {0};
+    struct stat config_stat;
+    if (stat(config_path, &config_stat) == 0)
+        config_modified = config_stat.st_mtim;
+
+    log_start(initial_config->log_file);
+    trace_start(initial_config->trace_file);
+    tls_start(initial_config->tls_ca_cert, initial_config->tls_ca_key, initial_config->tls_cert_cache,
+            initial_config->tls_key_pool, initial_config->tls_max_pumps, initial_config->tls_verify);
+
+    // grown when a reload raises the limit, never shrunk below the live connections
+    unsigned int capacity = initial_config->max_connection_count;
+    struct pollfd *connections = malloc((capacity * 2 + 1) * sizeof(struct pollfd)); // + listening socket
+    struct flow *flows = malloc(capacity * sizeof(struct flow));
     unsigned int connection_count = 0;
+    unsigned long next_flow_id = 1;
+    unsigned int round_robin = 0;
+    struct rate_limiter *client_limiter = rate_limiter_create();
+    struct rate_limiter *dest_limiter = rate_limiter_create();
+    struct socks_breaker *breaker = socks_breaker_create();
 
-    struct sockaddr addr;
-    struct addrinfo addrinfo;
+    unsigned int queue_capacity = initial_config->accept_queue;
+    struct pending_client *queue = malloc((queue_capacity + 1) * sizeof(struct pending_client));
+    unsigned int queue_length = 0;
+
+    struct rlimit fd_rlimit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_rlimit) == -1) {
+        perror("getrlimit failed");
+        exit(1);
+    }
+    // given up when accept runs out of descriptors, so the client can still be reset
+    int spare_fd = open("/dev/null", O_RDONLY);
+
+    // -1 once the listening socket was handed to a new process, the remaining flows are drained
+    int host_sockfd = -1;
+    const char *handoff_channel = getenv(HANDOFF_ENV);
+    if (handoff_channel != NULL) {
+        unsetenv(HANDOFF_ENV);
+        receive_handoff(atoi(handoff_channel), initial_config, &host_sockfd, &connections, &flows,
+                &capacity, &connection_count, &next_flow_id);
+    } else {
+        // the kernel's limit rather than max_connections: a burst is to reach admission control and the
+        // accept queue instead of having its SYNs dropped, and a reload can't resize the backlog anyway
+        host_sockfd = socks_listen(initial_config->port, SOMAXCONN);
+    }
+
+    struct sockaddr_storage addr;
     while (!interrupt_flag) {
-        // accept incoming connections
+        reload_config(config_path, &last_reload_check, &config_modified);
+
+        // NOTE: the snapshot must not be used after config_quiescent at the end of the iteration
+        const struct config *config = config_acquire();
+        if (config->max_connection_count > capacity) {
+            capacity = config->max_connection_count;
+            connections = realloc(connections, (capacity * 2 + 1) * sizeof(struct pollfd));
+            flows = realloc(flows, capacity * sizeof(struct flow));
+        }
+        if (config->accept_queue > queue_capacity) {
+            queue_capacity = config->accept_queue;
+            queue = realloc(queue, (queue_capacity + 1) * sizeof(struct pending_client));
+        }
+        breaker->failure_threshold = config->breaker_threshold;
+        breaker->negative_ttl = config->negative_ttl;
+        breaker->backoff = config->breaker_backoff;
+        breaker->max_backoff = config->breaker_max_backoff;
 
-        while (1) {
-            int client_sockfd = socks_accept(host_sockfd, 10, &addr);
-
-            if (client_sockfd >= 0 && connection_count < max_connection_count) {
-                int dest_sockfd = socks_establish_connection(client_sockfd, 300, &addrinfo);
-                if (dest_sockfd >= 0) {
-                    connections[connection_count * 2] = (struct pollfd){.fd = client_sockfd, .events = POLLIN | POLLHUP, .revents = 0};
-                    connections[connection_count * 2 + 1] = (struct pollfd){.fd = dest_sockfd, .events = POLLIN | POLLHUP, .revents = 0};
-                    ++connection_count;
-                } else {
-                    printf("[log] failed to establish connection with host: %s\n", socks_strerror(dest_sockfd));
-                    terminate_connection(client_sockfd);
+        if (upgrade_flag && host_sockfd != -1) {
+            upgrade_flag = 0;
+            if (handoff_to_new_process(argv, config, host_sockfd, connections, flows, connection_count, next_flow_id)) {
+                terminate_connection(host_sockfd);
+                host_sockfd = -1;
+                if (config->handoff_flows) {
+                    // the new process owns these now, only our copies are closed
+                    for (unsigned int i = 0; i < connection_count; ++i) {
+                        terminate_flow(&flows[i], &connections[i * 2]);
+                        if (flows[i].udp != NULL)
+                            socks_udp_free(flows[i].udp);
+                        free_flow_buffers(&flows[i]);
+                    }
+                    connection_count = 0;
                 }
-            } else if (client_sockfd == SOCKS_TIMEOUT || connection_count > max_connection_count)
+            }
+        }
+
+        // queued clients take the slots that freed up, in arrival order. those that waited too long are reset
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        unsigned int dequeued = 0;
+        for (; dequeued < queue_length; ++dequeued) {
+            struct pending_client *client = &queue[dequeued];
+            if (elapsed_us(&client->accepted, &now) / 1000 >= config->queue_timeout)
+                reject_client(client->sockfd, &client->addr, SOCKS_TIMEOUT);
+            else if (connection_count < config->max_connection_count)
+                start_flow(config, breaker, client, connections, flows, &connection_count, &next_flow_id);
+            else
                 break;
         }
+        memmove(queue, queue + dequeued, (queue_length - dequeued) * sizeof(struct pending_client));
+        queue_length -= dequeued;
 
-        // poll existing connections
-        int polled = poll(connections, connection_count * 2, 500);
-        if (polled < 0) {
-            if (errno == EINTR)
+        // accept incoming connections
+        for (unsigned int accepted = 0; host_sockfd != -1 && accepted < ACCEPT_BATCH; ++accepted) {
+            // the listening socket is polled together with the connections, so there's no need to wait here
+            struct pending_client client;
+            client.sockfd = socks_accept(host_sockfd, 0, (struct sockaddr*)&addr);
+            if (client.sockfd == SOCKS_OVERLOADED) {
+                // out of descriptors, the spare one makes room to reset the client instead of leaving it in the backlog
+                close(spare_fd);
+                int sockfd = accept(host_sockfd, NULL, NULL);
+                if (sockfd != -1)
+                    reject_client(sockfd, NULL, SOCKS_OVERLOADED);
+                spare_fd = open("/dev/null", O_RDONLY);
                 break;
+            }
+            if (client.sockfd == SOCKS_CONNECTION_TERMINATED)
+                continue;
+            if (client.sockfd < 0) // backlog empty or interrupted
+                break;
+            memcpy(&client.addr, &addr, sizeof(struct sockaddr_in));
+            clock_gettime(CLOCK_MONOTONIC, &client.accepted);
+
+            int status = admission_check(config, client.sockfd, fd_rlimit.rlim_cur, &client.accepted);
+            if (status < 0)
+                reject_client(client.sockfd, &client.addr, status);
+            else if (queue_length == 0 && connection_count < config->max_connection_count)
+                start_flow(config, breaker, &client, connections, flows, &connection_count, &next_flow_id);
+            else if (queue_length < config->accept_queue)
+                queue[queue_length++] = client;
+            else
+                reject_client(client.sockfd, &client.addr, SOCKS_OVERLOADED);
+        }
+
+        // poll existing connections, a side that ran out of tokens sits out until its buckets refilled
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int poll_timeout = 500;
+        if (queue_length > 0) {
+            int wait = config->queue_timeout - elapsed_us(&queue[0].accepted, &now) / 1000;
+            if (wait < poll_timeout)
+                poll_timeout = wait > 0 ? wait : 0;
+        }
+        for (unsigned int i = 0; i < connection_count; ++i) {
+            if (flows[i].request.pending) {
+                // the client is left alone until there is somewhere to send its bytes
+                int wait = config->connect_timeout - elapsed_us(&flows[i].connect_started, &now) / 1000;
+                connections[i * 2].events = 0;
+                connections[i * 2 + 1].events = flows[i].request.pending == SOCKS_PENDING_RESOLVE ? POLLIN : POLLOUT;
+                if (wait < poll_timeout)
+                    poll_timeout = wait > 0 ? wait : 0;
+                continue;
+            }
+
+            int wait = 0;
+            if (flows[i].udp == NULL)
+                available_tokens(config, client_limiter, dest_limiter, &flows[i], &now, &wait);
+            // a header that started arriving is dropped when the rest takes longer than message_timeout
+            for (unsigned int side = 0; side < 2; ++side) {
+                if (flows[i].header[side].length == 0)
+                    continue;
+                int header_wait = config->message_timeout - elapsed_us(&flows[i].header_started[side], &now) / 1000;
+                if (header_wait < poll_timeout)
+                    poll_timeout = header_wait > 0 ? header_wait : 0;
+            }
+
+            short events = wait > 0 ? POLLHUP : POLLIN | POLLHUP;
+            connections[i * 2].events = events;
+            connections[i * 2 + 1].events = events;
+            if (flows[i].body[0].mode == SOCKS_BODY_NONE && flow_paused(&flows[i]))
+                connections[i * 2].events = POLLHUP;
+            // a side with bytes pending isn't read from, its peer is waited on to take them instead
+            for (unsigned int side = 0; side < 2; ++side) {
+                if (flows[i].pending[side].length > 0 || flows[i].closing)
+                    connections[i * 2 + side].events &= ~POLLIN;
+                if (flows[i].pending[side].length > 0)
+                    connections[i * 2 + 1 - side].events |= POLLOUT;
+            }
+            if (wait > 0 && wait < poll_timeout)
+                poll_timeout = wait;
+        }
+        connections[connection_count * 2] = (struct pollfd){.fd = host_sockfd, .events = POLLIN, .revents = 0};
+        int polled = poll(connections, connection_count * 2 + 1, poll_timeout);
+        if (polled < 0) {
+            if (errno == EINTR) // SIGINT ends the loop, SIGHUP reloads on the next iteration
+                continue;
             perror("poll failed");
             exit(1);
         } 
-        unsigned int handled = 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // one deficit round robin round: every ready side gets a quantum, the flow served first rotates
         unsigned int closed = 0;
-        for (unsigned int i = 0; handled < polled; ++i) {
-            if (connections[i].fd == -1) {
-                if (connections[i].revents != 0)
-                    ++handled;
-                continue;
+        unsigned int first = connection_count > 0 ? round_robin++ % connection_count : 0;
+        for (unsigned int k = 0; k < connection_count; ++k) {
+            unsigned int flow_idx = (first + k) % connection_count;
+            trace_flow(flows[flow_idx].id, flows[flow_idx].traced);
+            if (flows[flow_idx].request.pending) {
+                int status = finish_pending_connection(config, breaker, &flows[flow_idx], &connections[flow_idx * 2], &now);
+                if (status < 0) {
+                    closed += 2;
+                    continue;
+                }
+                // a client that hung up meanwhile is closed below
+                if (status == 0 && !(connections[flow_idx * 2].revents & POLLHUP))
+                    continue;
             }
+            for (unsigned int i = flow_idx * 2; i < flow_idx * 2 + 2 && connections[i].fd != -1; ++i) {
+                unsigned int dest_idx = (i % 2 == 0) ? i + 1 : i - 1;
+                struct flow *flow = &flows[flow_idx];
 
-            unsigned int dest_idx = (i % 2 == 0) ? i + 1 : i - 1;
-
-            if (connections[i].revents & POLLHUP) {
-                close_connection:
-                printf("[log] closed connection\n");
-                terminate_connection(connections[i].fd);
-                terminate_connection(connections[dest_idx].fd);
-                connections[i].fd = -1;
-                connections[dest_idx].fd = -1;
-                ++handled;
-                closed += 2;
-            } else if (connections[i].revents & POLLIN) {
-                char *http_message;
-                size_t length;
-
-                int status = socks_read_http_message(connections[i].fd, 60000, &http_message, &length);
-                if (status < 0 && status != SOCKS_SYSTEM_INTERRUPT) {
-                    if (status != SOCKS_CONNECTION_TERMINATED)
-                        printf("[log] received invalid http message: %s\n", socks_strerror(status));
+                if (connections[i].revents & POLLHUP) {
+                    close_connection:
+                    if (flow->udp != NULL) {
+                        flow->bytes_in = flow->udp->bytes_in;
+                        flow->bytes_out = flow->udp->bytes_out;
+                    }
+                    log_event(LOG_CLOSED, 0, flow->id, &flow->client_addr, &flow->request.dest_addr, flow->bytes_in, flow->bytes_out);
+                    terminate_flow(flow, &connections[flow_idx * 2]);
+                    if (flow->udp != NULL) {
+                        socks_udp_free(flow->udp);
+                        flow->udp = NULL;
+                    }
+                    free_flow_buffers(flow);
+                    closed += 2;
+                } else if (flow->header[i % 2].length > 0
+                        && elapsed_us(&flow->header_started[i % 2], &now) / 1000 >= config->message_timeout) {
+                    // slowloris: the header trickles in, or stopped halfway
+                    log_event(LOG_INVALID_MESSAGE, SOCKS_TIMEOUT, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
                     goto close_connection;
-                }
-                
-                if (i % 2 == 0) {
-                    editor_modify_message(http_message, length);
-                }
+                } else if (flow->udp != NULL && (connections[i].revents & POLLIN)) {
+                    if (i % 2 == 0) {
+                        // the association lives as long as its control connection, nothing else is expected on it
+                        char discard[64];
+                        ssize_t status = recv(connections[i].fd, discard, sizeof(discard), MSG_DONTWAIT);
+                        if (status == 0 || (status == -1 && errno != EAGAIN && errno != EINTR))
+                            goto close_connection;
+                    } else {
+                        struct trace_span span;
+                        trace_begin(&span, "udp relay");
+                        int status = socks_udp_relay(flow->udp, 16);
+                        trace_end(&span);
+                        if (status < 0 && status != SOCKS_SYSTEM_INTERRUPT) {
+                            log_event(LOG_UDP_FAILED, status, flow->id, &flow->client_addr, &flow->request.dest_addr, 0, 0);
+                            goto close_connection;
+                        }
+                    }
+                } else if (connections[i].revents & (POLLIN | POLLOUT)) {
+                    unsigned int side = i % 2;
+                    if ((connections[i].revents & POLLOUT) && flow->pending[1 - side].length > 0) {
+                        ssize_t sent = flush_pending(flow, side, connections[i].fd);
+                        if (sent < 0)
+                            goto close_connection;
+                        // charged to the side the bytes came from, like bytes that went out right away
+                        spend_tokens(config, client_limiter, dest_limiter, flow, &now, sent);
+                        flow->deficit[1 - side] -= sent;
+                        if (flow->closing && flow->pending[0].length == 0 && flow->pending[1].length == 0)
+                            goto close_connection;
+                    }
+                    if (!(connections[i].revents & POLLIN) || flow->pending[side].length > 0 || flow->closing)
+                        continue;
 
-                status = socks_send_http_message(connections[dest_idx].fd, http_message, length);
-                if (status < 0) {
-                    printf("[log] could not send an http message back: %s\n", socks_strerror(status));
-                    goto close_connection;
-                }
+                    if (side == 0 && !flow->tls && flow->bytes_in == 0 && flow->header[0].length == 0 && flow->body[0].mode == SOCKS_BODY_NONE) {
+                        if (detect_tls(config, flow, &connections[i], &connections[dest_idx]) < 0)
+                            goto close_connection;
+                        // what was polled belongs to the pump thread now, the plaintext is relayed from the next round
+                        if (flow->tls)
+                            break;
+                    }
+                    flow->deficit[side] += config->sched_quantum;
+                    if (flow->deficit[side] <= 0) // overdrawn by a large header or intercepted message
+                        continue;
 
-                free(http_message);
-                ++handled;
+                    int wait;
+                    size_t budget = available_tokens(config, client_limiter, dest_limiter, flow, &now, &wait);
+                    if (budget > flow->deficit[side])
+                        budget = flow->deficit[side];
+                    if (budget == 0)
+                        continue;
+
+                    ssize_t relayed = relay_http(config, flow, side, connections[i].fd, connections[dest_idx].fd, budget);
+                    if (relayed == SOCKS_SYSTEM_INTERRUPT)
+                        continue;
+                    // the side ended, but what it sent before still has to reach the other one
+                    if (relayed == SOCKS_CONNECTION_TERMINATED && flow->pending[side].length > 0) {
+                        flow->closing = 1;
+                        continue;
+                    }
+                    if (relayed < 0)
+                        goto close_connection;
+
+                    spend_tokens(config, client_limiter, dest_limiter, flow, &now, relayed);
+                    flow->deficit[side] -= relayed;
+                    // a side that had less than its share queued doesn't bank the rest
+                    if (relayed < budget && flow->deficit[side] > 0)
+                        flow->deficit[side] = 0;
+                }
             }
         }
 
         // remove closed connections from the queue
-        remove_closed_sockets(connections, connection_count * 2);
+        remove_closed_sockets(connections, flows, connection_count * 2);
         connection_count -= closed/2;
+
+        config_quiescent(&config_reader);
+        config_reclaim();
+
+        // drained after a handoff, flows that were handed off still need our tls pump threads until they end
+        if (host_sockfd == -1 && connection_count == 0 && queue_length == 0 && tls_active() == 0)
+            break;
     }
 
     if (interrupt_flag)
         printf("\nKeyboard interrupt (quitting)\n");
+    tls_stop();
+    log_stop();
+    trace_stop();
 
     for (unsigned int i = 0; i < connection_count; ++i)
-        terminate_connection(connections[i].fd);
+        terminate_flow(&flows[i], &connections[i * 2]);
+    for (unsigned int i = 0; i < queue_length; ++i)
+        terminate_connection(queue[i].sockfd);
+    free(queue);
+    free(connections);
+    free(flows);
+    rate_limiter_free(client_limiter);
+    rate_limiter_free(dest_limiter);
+    socks_breaker_free(breaker);
 }
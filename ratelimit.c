@@ -0,0 +1,42 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ratelimit.h"
+
+struct rate_limiter *rate_limiter_create(void) {
+    return calloc(1, sizeof(struct rate_limiter));
+}
+
+void rate_limiter_free(struct rate_limiter *limiter) {
+    free(limiter);
+}
+
+// returns the refilled bucket of addr. rate and burst come from the current config, so a reload applies
+// to every bucket on its next refill
+struct token_bucket *rate_limiter_bucket(struct rate_limiter *limiter, struct in_addr addr, const struct timespec *now,
+        unsigned long rate, unsigned long burst) {
+    unsigned int hash = addr.s_addr * 2654435761u;
+    struct token_bucket *bucket = &limiter->buckets[hash >> 20 & (RATE_LIMITER_SIZE - 1)];
+
+    double elapsed = (now->tv_sec - bucket->last_refill.tv_sec) + (now->tv_nsec - bucket->last_refill.tv_nsec) / 1e9;
+    if (!bucket->used) {
+        bucket->used = 1;
+        bucket->addr = addr;
+        bucket->tokens = burst;
+    } else {
+        bucket->tokens += elapsed * rate;
+        if (bucket->tokens > burst)
+            bucket->tokens = burst;
+        if (bucket->addr.s_addr != addr.s_addr && bucket->tokens == burst)
+            bucket->addr = addr;
+    }
+    bucket->last_refill = *now;
+    return bucket;
+}
+
+// milliseconds until the bucket holds wanted tokens
+int token_bucket_wait(const struct token_bucket *bucket, unsigned long rate, size_t wanted) {
+    if (bucket->tokens >= wanted || rate == 0)
+        return 0;
+    return (wanted - bucket->tokens) * 1000 / rate + 1;
+}
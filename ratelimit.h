@@ -0,0 +1,29 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <time.h>
+#include <netinet/in.h>
+
+// buckets per limiter, a power of two
+#define RATE_LIMITER_SIZE 4096
+
+struct token_bucket {
+    struct in_addr addr;
+    double tokens;
+    struct timespec last_refill;
+    char used;
+};
+
+// NOTE: direct mapped by address. when two busy addresses collide they share a bucket, an idle (full)
+// bucket is simply taken over by the newcomer
+struct rate_limiter {
+    struct token_bucket buckets[RATE_LIMITER_SIZE];
+};
+
+struct rate_limiter *rate_limiter_create(void);
+void rate_limiter_free(struct rate_limiter *limiter);
+struct token_bucket *rate_limiter_bucket(struct rate_limiter *limiter, struct in_addr addr, const struct timespec *now,
+        unsigned long rate, unsigned long burst);
+int token_bucket_wait(const struct token_bucket *bucket, unsigned long rate, size_t wanted);
+
+#endif // RATELIMIT_H
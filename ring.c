@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ring.h"
+
+static void ring_orphan(void *ring) {
+    atomic_store(&((struct ring*)ring)->orphaned, 1);
+}
+
+static struct ring *ring_register(struct ring_set *set) {
+    struct ring *ring = calloc(1, sizeof(struct ring) + set->ring_size * set->record_size);
+    pthread_setspecific(set->key, ring);
+
+    pthread_mutex_lock(&set->lock);
+    ring->next = set->rings;
+    set->rings = ring;
+    pthread_mutex_unlock(&set->lock);
+    return ring;
+}
+
+// the slot for the next record of the calling thread, NULL when its ring is full (the record is counted as dropped)
+void *ring_reserve(struct ring_set *set, struct ring **out) {
+    if (!atomic_load_explicit(&set->running, memory_order_relaxed))
+        return NULL;
+    struct ring *ring = pthread_getspecific(set->key);
+    if (ring == NULL)
+        ring = ring_register(set);
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == set->ring_size) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+    *out = ring;
+    return ring->records + (head & (set->ring_size - 1)) * set->record_size;
+}
+
+// hands the reserved record to the writer
+void ring_commit(struct ring *ring) {
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// formats everything currently in the rings, returns 0 when all of them were empty
+static char ring_drain(struct ring_set *set) {
+    char drained = 0;
+    pthread_mutex_lock(&set->lock);
+    struct ring **i = &set->rings;
+    while (*i != NULL) {
+        struct ring *ring = *i;
+        char orphaned = atomic_load(&ring->orphaned);
+
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; ++tail) {
+            set->format(ring->records + (tail & (set->ring_size - 1)) * set->record_size);
+            drained = 1;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped != 0) {
+            set->dropped(dropped);
+            drained = 1;
+        }
+
+        if (orphaned) {
+            *i = ring->next;
+            free(ring);
+        } else
+            i = &ring->next;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return drained;
+}
+
+static void *ring_writer(void *arg) {
+    struct ring_set *set = arg;
+    const struct timespec interval = {.tv_sec = set->flush_interval / 1000, .tv_nsec = set->flush_interval % 1000 * 1000000L};
+    while (atomic_load(&set->running)) {
+        if (ring_drain(set))
+            fflush(set->stream);
+        nanosleep(&interval, NULL);
+    }
+    ring_drain(set);
+    fflush(set->stream);
+    return NULL;
+}
+
+void ring_start(struct ring_set *set) {
+    pthread_mutex_init(&set->lock, NULL);
+    set->rings = NULL;
+    pthread_key_create(&set->key, ring_orphan);
+    atomic_store(&set->running, 1);
+
+    int status = pthread_create(&set->writer, NULL, ring_writer, set);
+    if (status != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(status));
+        exit(1);
+    }
+}
+
+// drains what is left and stops the writer, the stream is left to the owner
+void ring_stop(struct ring_set *set) {
+    atomic_store(&set->running, 0);
+    pthread_join(set->writer, NULL);
+}
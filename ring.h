@@ -0,0 +1,42 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// single producer (the owning thread), single consumer (the writer thread)
+struct ring {
+    atomic_ulong head; // next slot the producer writes
+    atomic_ulong tail; // next slot the consumer reads
+    atomic_ulong dropped; // since the writer last reported
+    atomic_char orphaned; // owning thread exited, freed by the writer once drained
+    struct ring *next;
+    _Alignas(max_align_t) unsigned char records[];
+};
+
+// NOTE: fixed size records of one kind (log events, trace spans) are copied into a ring of the producing thread on
+// the hot path and formatted by a writer thread every flush_interval ms. the owner fills in everything above lock
+// and calls ring_start, records produced before that or after ring_stop are discarded
+struct ring_set {
+    size_t record_size;
+    unsigned long ring_size; // records per thread, a power of two
+    int flush_interval; // ms
+    FILE *stream; // flushed after every drain that formatted something
+    void (*format)(const void *record);
+    void (*dropped)(unsigned long count); // records lost to a full ring since the last call
+
+    pthread_mutex_t lock;
+    struct ring *rings;
+    pthread_key_t key;
+    pthread_t writer;
+    atomic_char running;
+};
+
+void ring_start(struct ring_set *set);
+void ring_stop(struct ring_set *set);
+void *ring_reserve(struct ring_set *set, struct ring **ring);
+void ring_commit(struct ring *ring);
+
+#endif // RING_H
@@ -1,18 +1,26 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
-#define __USE_GNU
+#include <limits.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 
 #include "socks5.h"
+#include "socks5_udp.h"
+#include "socks5_breaker.h"
+#include "trace.h"
+#include "log.h"
 
 #define MAX_HTTP_HEADER_SIZE 32000
-#define MAX_HTTP_BODY_SIZE 128000
 
 const char *socks_strerror(int error) {
     switch (error) {
@@ -36,11 +44,27 @@ const char *socks_strerror(int error) {
             return "Invalid HTTP syntax";
         case SOCKS_SYSTEM_INTERRUPT:
             return "Interrupted by a signal";
+        case SOCKS_SPILL_FAILED:
+            return "Could not spill the message to a temp file";
+        case SOCKS_OVERLOADED:
+            return "Proxy is overloaded";
+        case SOCKS_TLS_FAILED:
+            return "TLS handshake failed";
+        case SOCKS_EDITOR_FAILED:
+            return "Could not run the editor";
         default:
             return "";
     }
 }
 
+// fnv-1a over the host and the port, for the tables keyed by destination
+unsigned int socks_hash_host(const char *host, unsigned short port) {
+    unsigned int hash = 2166136261u;
+    for (const char *i = host; *i != 0; ++i)
+        hash = (hash ^ (unsigned char)*i) * 16777619u;
+    return (hash ^ port) * 16777619u;
+}
+
 int socks_listen(unsigned short port, unsigned int backlog) {
     struct addrinfo hints, *res;
     memset(&hints, 0, sizeof(hints));
@@ -48,7 +72,7 @@ int socks_listen(unsigned short port, unsigned int backlog) {
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
     
-    char service_port[5];
+    char service_port[6];
     sprintf(service_port, "%u", port);
 
     int error;
@@ -106,6 +130,8 @@ int socks_accept(int sockfd, int timeout, struct sockaddr *client_addr) {
             return SOCKS_CONNECTION_TERMINATED;
         if (errno == EINTR)
             return SOCKS_SYSTEM_INTERRUPT;
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            return SOCKS_OVERLOADED;
 
         perror("accept failed");
         exit(1);
@@ -113,39 +139,230 @@ int socks_accept(int sockfd, int timeout, struct sockaddr *client_addr) {
     return client_sockfd;
 }
 
-int socks_connect_to_destination(struct addrinfo *dest_info) { // TODO: maybe add timeout
-    int sockfd = socket(dest_info->ai_family, dest_info->ai_socktype, dest_info->ai_protocol);
+// starts a non-blocking connect, returns the socket or -1 with errno set
+int socks_connect_start(struct addrinfo *dest_info) {
+    int sockfd = socket(dest_info->ai_family, dest_info->ai_socktype | SOCK_NONBLOCK, dest_info->ai_protocol);
     if (sockfd == -1) {
         perror("socket failed");
         exit(1);
     }
-    if (connect(sockfd, dest_info->ai_addr, dest_info->ai_addrlen) == -1) {
+
+    if (connect(sockfd, dest_info->ai_addr, dest_info->ai_addrlen) == -1 && errno != EINPROGRESS) {
         switch (errno) {
             case EALREADY:
             case EBADF:
-            case EINPROGRESS:
             case EISCONN:
             case ENOTSOCK:
             case EPROTOTYPE:
-            case EACCES:
             case EADDRINUSE:
             case EINVAL:
             case ELOOP:
             case ENAMETOOLONG:
-            case ENETDOWN:
             case ENOBUFS:
             case EOPNOTSUPP:
                 perror("connect failed internally");
                 exit(1);
-                break;
-
-            default:
+            default: {
+                int error = errno;
+                close(sockfd);
+                errno = error;
                 return -1;
+            }
         }
     }
     return sockfd;
 }
 
+// called once the socket turned writable, returns 0 or the errno of the connect.
+// a connected socket is switched back to blocking, the relay works on those
+int socks_connect_finish(int sockfd) {
+    int error;
+    socklen_t length = sizeof(error);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+        return errno;
+    if (error != 0)
+        return error;
+
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK) == -1) {
+        perror("fcntl failed");
+        exit(1);
+    }
+    return 0;
+}
+
+// returns the connected socket, or -1 with errno set (ETIMEDOUT once timeout ms passed)
+int socks_connect_to_destination(struct addrinfo *dest_info, int timeout) {
+    int sockfd = socks_connect_start(dest_info);
+    if (sockfd == -1)
+        return -1;
+
+    struct pollfd pollfds[1] = {{.fd = sockfd, .events = POLLOUT}};
+    int status = poll(pollfds, 1, timeout);
+    int error;
+    if (status == -1)
+        error = errno;
+    else if (status == 0)
+        error = ETIMEDOUT;
+    else
+        error = socks_connect_finish(sockfd);
+
+    if (error != 0) {
+        close(sockfd);
+        errno = error;
+        return -1;
+    }
+    return sockfd;
+}
+
+// the reply for a failed connect, SOCKS_REP_GENERAL_FAILURE when the error says nothing about the destination
+unsigned char socks_connect_reply(int error) {
+    switch (error) {
+        case EADDRNOTAVAIL:
+        case ETIMEDOUT:
+        case EHOSTUNREACH:
+            return SOCKS_REP_HOST_UNREACHABLE;
+        case ECONNREFUSED:
+            return SOCKS_REP_CONNECTION_REFUSED;
+        case EAFNOSUPPORT:
+        case ENETUNREACH:
+            return SOCKS_REP_NETWORK_UNREACHABLE;
+        default:
+            return SOCKS_REP_GENERAL_FAILURE;
+    }
+}
+
+// finishes the connect of a pending request (see socks_establish_connection) once its socket turned writable
+// or the connect timed out. the caller closes the flow on error, the client already got its reply
+int socks_complete_connection(int dest_sockfd, char timed_out, struct socks_breaker *breaker, struct socks_request *request) {
+    int error = timed_out ? ETIMEDOUT : socks_connect_finish(dest_sockfd);
+    request->pending = SOCKS_PENDING_NONE;
+
+    unsigned char reply = error == 0 ? SOCKS_REP_SUCCEEDED : socks_connect_reply(error);
+    if (breaker != NULL && (error == 0 || reply != SOCKS_REP_GENERAL_FAILURE))
+        socks_breaker_report(breaker, request->host, request->port, reply);
+    return error == 0 ? SOCKS_OK : SOCKS_DESTINATION_UNREACHABLE;
+}
+
+enum socks_resolve_states {
+    SOCKS_RESOLVE_RUNNING,
+    SOCKS_RESOLVE_DONE,
+    SOCKS_RESOLVE_ABANDONED
+};
+
+// NOTE: shared by the loop and the thread glibc notifies from, whichever of them is done with it last frees it.
+// the eventfd belongs to it as well, the loop only polls it
+struct socks_resolve {
+    struct gaicb request;
+    struct addrinfo hints;
+    char host[256];
+    char service[6];
+    int eventfd;
+    atomic_int state;
+};
+
+static void socks_resolve_free(struct socks_resolve *resolve) {
+    if (resolve->request.ar_result != NULL)
+        freeaddrinfo(resolve->request.ar_result);
+    close(resolve->eventfd);
+    free(resolve);
+}
+
+static void socks_resolve_notify(union sigval value) {
+    struct socks_resolve *resolve = value.sival_ptr;
+    uint64_t one = 1;
+    write(resolve->eventfd, &one, sizeof(one));
+    if (atomic_exchange(&resolve->state, SOCKS_RESOLVE_DONE) == SOCKS_RESOLVE_ABANDONED)
+        socks_resolve_free(resolve);
+}
+
+// looks the host of an optimistically answered request up without blocking the loop. returns a descriptor that
+// turns readable once the lookup finished, then socks_resolve_finish starts the connect
+int socks_resolve_start(struct socks_request *request) {
+    struct socks_resolve *resolve = calloc(1, sizeof(struct socks_resolve));
+    resolve->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (resolve->eventfd == -1) {
+        free(resolve);
+        return SOCKS_OVERLOADED;
+    }
+    // NOTE: the request moves around with its flow, the lookup gets its own copy of the name
+    memcpy(resolve->host, request->host, sizeof(resolve->host));
+    sprintf(resolve->service, "%u", request->port);
+    resolve->hints.ai_family = AF_INET;
+    resolve->hints.ai_socktype = SOCK_STREAM;
+    resolve->request.ar_name = resolve->host;
+    resolve->request.ar_service = resolve->service;
+    resolve->request.ar_request = &resolve->hints;
+
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD;
+    event.sigev_notify_function = socks_resolve_notify;
+    event.sigev_value.sival_ptr = resolve;
+    struct gaicb *list[1] = {&resolve->request};
+    if (getaddrinfo_a(GAI_NOWAIT, list, 1, &event) != 0) {
+        close(resolve->eventfd);
+        free(resolve);
+        return SOCKS_OVERLOADED;
+    }
+
+    request->resolve = resolve;
+    request->pending = SOCKS_PENDING_RESOLVE;
+    return resolve->eventfd;
+}
+
+// drops the lookup of a request, the result is thrown away whenever it arrives
+void socks_resolve_cancel(struct socks_request *request) {
+    if (request->pending != SOCKS_PENDING_RESOLVE)
+        return;
+    struct socks_resolve *resolve = request->resolve;
+    request->resolve = NULL;
+    request->pending = SOCKS_PENDING_NONE;
+    if (atomic_exchange(&resolve->state, SOCKS_RESOLVE_ABANDONED) == SOCKS_RESOLVE_DONE)
+        socks_resolve_free(resolve);
+}
+
+// called once the descriptor of socks_resolve_start turned readable or the lookup timed out. returns the socket
+// of the connect that was started (the request is SOCKS_PENDING_CONNECT then), the lookup's descriptor is gone
+int socks_resolve_finish(char timed_out, struct socks_breaker *breaker, struct socks_request *request) {
+    struct socks_resolve *resolve = request->resolve;
+    int status = timed_out ? EAI_AGAIN : gai_error(&resolve->request);
+    if (status != 0) {
+        // the resolver failing says nothing about the destination, don't hold it against it
+        if (breaker != NULL && (status == EAI_NONAME || status == EAI_SERVICE || status == EAI_NODATA || status == EAI_ADDRFAMILY))
+            socks_breaker_report(breaker, request->host, request->port, SOCKS_REP_HOST_UNREACHABLE);
+        socks_resolve_cancel(request);
+        return SOCKS_DESTINATION_UNREACHABLE;
+    }
+
+    struct addrinfo *results = resolve->request.ar_result;
+    int sockfd = socks_connect_start(results);
+    int error = errno;
+    if (sockfd != -1)
+        memcpy(&request->dest_addr, results->ai_addr, sizeof(struct sockaddr_in));
+    socks_resolve_cancel(request);
+    if (sockfd == -1) {
+        unsigned char reply = socks_connect_reply(error);
+        if (breaker != NULL && reply != SOCKS_REP_GENERAL_FAILURE)
+            socks_breaker_report(breaker, request->host, request->port, reply);
+        return SOCKS_DESTINATION_UNREACHABLE;
+    }
+    request->pending = SOCKS_PENDING_CONNECT;
+    return sockfd;
+}
+
+// a recv, send or poll failed with something other than EINTR. only programming errors end the process,
+// anything else (ETIMEDOUT from keepalive, EHOSTUNREACH, ENOMEM, ...) ends just this connection
+static int socks_io_failed(const char *what) {
+    int error = errno;
+    if (error == EBADF || error == EFAULT || error == ENOTSOCK || error == EINVAL) {
+        perror(what);
+        exit(1);
+    }
+    if (error != ECONNRESET && error != EPIPE)
+        log_event(LOG_IO_FAILED, error, 0, NULL, NULL, 0, 0);
+    return SOCKS_CONNECTION_TERMINATED;
+}
+
 // accept_less: allow receival of less data than specified
 int recvn(int sockfd, void *buffer, size_t n, int timeout, char accept_less, int recv_flags) { 
     size_t received = 0;
@@ -158,8 +375,7 @@ int recvn(int sockfd, void *buffer, size_t n, int timeout, char accept_less, int
         if (poll_status == -1) {
             if (errno == EINTR)
                 return SOCKS_SYSTEM_INTERRUPT;
-            perror("poll failed");
-            exit(1);
+            return socks_io_failed("poll failed");
         }
         if (poll_status == 0) {
             if (accept_less)
@@ -171,8 +387,7 @@ int recvn(int sockfd, void *buffer, size_t n, int timeout, char accept_less, int
         if (bytes_read == -1) {
             if (errno == EINTR)
                 return SOCKS_SYSTEM_INTERRUPT;
-            perror("recv failed");
-            exit(1);
+            return socks_io_failed("recv failed");
         }
         if (bytes_read == 0)
             return SOCKS_CONNECTION_TERMINATED;
@@ -200,18 +415,16 @@ int sendn(int sockfd, const void *message, size_t n, int flags) {
     size_t sent = 0;
     ssize_t bytes_sent;
     while (sent < n) {
-        bytes_sent = send(sockfd, message, n, flags);
+        bytes_sent = send(sockfd, message, n - sent, flags);
         if (bytes_sent == -1) {
-            if (errno == ECONNRESET)
-                return SOCKS_CONNECTION_TERMINATED;
             if (errno == EINTR)
                 return SOCKS_SYSTEM_INTERRUPT;
-            perror("send failed");
-            exit(1);
+            return socks_io_failed("send failed");
         }
         sent += bytes_sent;
         message += bytes_sent;
     }
+    return sent;
 }
 
 int send_short(int sockfd, const short message, int flags) {
@@ -224,7 +437,13 @@ int send_long(int sockfd, const long message, int flags) {
     return sendn(sockfd, &converted, sizeof(long), flags);
 }
 
-int socks_establish_connection(int client_sockfd, int timeout, struct addrinfo *dest) {
+// connect_timeout bounds the connect to the destination, breaker (may be NULL) answers destinations that
+// failed recently without trying them again.
+// with optimistic set a connect request is answered before resolving and connecting. the returned descriptor
+// is still connecting then (request->pending) and has to be finished with socks_complete_connection, for a
+// domain name it's the lookup's (SOCKS_PENDING_RESOLVE), socks_resolve_finish trades it for the connecting socket
+int socks_establish_connection(int client_sockfd, int timeout, int connect_timeout, char optimistic,
+        struct socks_breaker *breaker, struct addrinfo *dest, struct socks_request *request) {
     const unsigned char version = SOCKS_VERSION;
     const unsigned char method = SOCKS_NO_AUTH; // no auth (TODO: implement more methods)
     const unsigned char no_method = SOCKS_UNSUITABLE;
@@ -242,7 +461,7 @@ int socks_establish_connection(int client_sockfd, int timeout, struct addrinfo *
     unsigned char auth_count = buf[1];
     unsigned char res_template[] = {SOCKS_VERSION, SOCKS_REP_SUCCEEDED, 0x00, SOCKS_IPV4, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
     char auth_methods[255];
-    if ((socks_code == recvn(client_sockfd, auth_methods, auth_count, timeout, 0, 0)) < 0)
+    if ((socks_code = recvn(client_sockfd, auth_methods, auth_count, timeout, 0, 0)) < 0)
         return socks_code;
     
     char method_available = 0;
@@ -273,17 +492,17 @@ int socks_establish_connection(int client_sockfd, int timeout, struct addrinfo *
         return socks_code;
     if (client_request_header.version != SOCKS_VERSION)
         goto req_invalid_version;
-    if (client_request_header.command != SOCKS_CONNECT) // TODO: implement other commands
+    if (client_request_header.command != SOCKS_CONNECT && client_request_header.command != SOCKS_UDP_ASSOCIATE) // TODO: implement bind
         goto command_not_supported;
     if (client_request_header.atyp != SOCKS_IPV4 && client_request_header.atyp != SOCKS_DOMAINNAME) // TODO: ipv6
         goto address_type_not_supported;
 
-    unsigned char address[256];
+    char address[256];
     if (client_request_header.atyp == SOCKS_IPV4) {
-        if ((socks_code = recvn(client_sockfd, address, sizeof(struct in_addr), timeout, 0, 0)) < 0)
+        struct in_addr ipv4_address;
+        if ((socks_code = recvn(client_sockfd, &ipv4_address, sizeof(struct in_addr), timeout, 0, 0)) < 0)
             return socks_code;
-        inet_ntop(AF_INET, address, address, INET_ADDRSTRLEN);
-        address[4] = 0;
+        inet_ntop(AF_INET, &ipv4_address, address, INET_ADDRSTRLEN);
     }
     else if (client_request_header.atyp == SOCKS_DOMAINNAME) {
         unsigned char domain_length;
@@ -300,9 +519,51 @@ int socks_establish_connection(int client_sockfd, int timeout, struct addrinfo *
     unsigned short port;  
     if ((socks_code = recv_short(client_sockfd, &port, timeout, 0)) < 0)
         return socks_code;
+
+    request->command = client_request_header.command;
+    request->atyp = client_request_header.atyp;
+    memcpy(request->host, address, strlen(address) + 1);
+    request->port = port;
+    request->pending = SOCKS_PENDING_NONE;
+    request->resolve = NULL;
+    memset(&request->dest_addr, 0, sizeof(request->dest_addr));
+
+    if (client_request_header.command == SOCKS_UDP_ASSOCIATE) {
+        // the relay socket is bound next to the control connection, its address goes into BND.ADDR/BND.PORT
+        int udp_sockfd = socks_udp_open(client_sockfd, res_template + 4);
+        if (udp_sockfd == SOCKS_OVERLOADED) {
+            res_template[1] = SOCKS_REP_GENERAL_FAILURE;
+            sendn(client_sockfd, res_template, sizeof(res_template), 0);
+            return SOCKS_OVERLOADED;
+        }
+        if (udp_sockfd < 0)
+            goto general_failure;
+
+        if ((socks_code = sendn(client_sockfd, res_template, sizeof(res_template), 0)) < 0) {
+            close(udp_sockfd);
+            return socks_code;
+        }
+        memset(dest, 0, sizeof(struct addrinfo));
+        return udp_sockfd;
+    }
     
-    // connect to destination
-    char service[5];
+    // connect to destination, unless it failed recently
+    char replied = 0;
+    if (breaker != NULL && (res_template[1] = socks_breaker_check(breaker, address, port)) != SOCKS_REP_SUCCEEDED)
+        goto destination_failed;
+
+    // the client's first bytes wait in the socket buffer while we resolve and connect
+    if (optimistic && (socks_code = sendn(client_sockfd, res_template, sizeof(res_template), 0)) < 0)
+        return socks_code;
+    replied = optimistic;
+
+    // a name is looked up off the loop, the connect starts once the answer is in (socks_resolve_finish)
+    if (optimistic && client_request_header.atyp == SOCKS_DOMAINNAME) {
+        memset(dest, 0, sizeof(struct addrinfo));
+        return socks_resolve_start(request);
+    }
+
+    char service[6];
     sprintf(service, "%u", port);
 
     struct addrinfo hints;
@@ -310,50 +571,74 @@ int socks_establish_connection(int client_sockfd, int timeout, struct addrinfo *
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
+    struct trace_span span;
+    trace_begin(&span, "resolve");
     int status = getaddrinfo(address, service, &hints, &results);
+    trace_end(&span);
     if (status != 0) {
-        if (status == EAI_NONAME || status == EAI_SERVICE
-                || status == EAI_FAIL || status == EAI_AGAIN
-                || status == EAI_NODATA || status == EAI_ADDRFAMILY) {
-            goto host_unreachable;
+        if (status == EAI_NONAME || status == EAI_SERVICE || status == EAI_NODATA || status == EAI_ADDRFAMILY) {
+            res_template[1] = SOCKS_REP_HOST_UNREACHABLE;
+            goto report_failure;
+        } else if (status == EAI_FAIL || status == EAI_AGAIN) {
+            // the resolver failing says nothing about the destination, don't hold it against it
+            res_template[1] = SOCKS_REP_HOST_UNREACHABLE;
+            goto destination_failed;
+        } else if (status == EAI_SYSTEM && errno == EINTR) {
+            return SOCKS_SYSTEM_INTERRUPT;
         } else {
             fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
             exit(1);
         }
     }
 
-    int dest_sockfd = socks_connect_to_destination(results);
+    // an optimistic connect is traced when it finishes
+    if (!optimistic)
+        trace_begin(&span, "connect");
+    int dest_sockfd = optimistic ? socks_connect_start(results) : socks_connect_to_destination(results, connect_timeout);
+    if (!optimistic)
+        trace_end(&span);
     if (dest_sockfd == -1) {
-        switch (errno) {
-            // host unreachable
-            case EADDRNOTAVAIL:
-            case ETIMEDOUT:
-            case EHOSTUNREACH:
-                goto host_unreachable;
-
-            // connection refused
-            case ECONNREFUSED:
-                goto connection_refused;
-
-            // network unreachable
-            case EAFNOSUPPORT:
-            case ENETUNREACH:
-                goto network_unreachable;
-
-            case EINTR:
-                return SOCKS_SYSTEM_INTERRUPT;
-        }
+        int error = errno;
+        freeaddrinfo(results);
+        if (error == EINTR)
+            return SOCKS_SYSTEM_INTERRUPT;
+        res_template[1] = socks_connect_reply(error);
+        if (res_template[1] == SOCKS_REP_GENERAL_FAILURE)
+            goto destination_failed;
+        goto report_failure;
     }
 
-    if ((socks_code = sendn(client_sockfd, res_template, sizeof(res_template), 0)) < 0)
-        return socks_code;
-
+    memcpy(&request->dest_addr, results->ai_addr, sizeof(struct sockaddr_in));
+    // NOTE: the address lives on in request->dest_addr, dest only keeps the socket parameters
     memcpy(dest, results, sizeof(struct addrinfo));
-    freeaddrinfo(results);
+    dest->ai_addr = NULL;
+    dest->ai_canonname = NULL;
     dest->ai_next = NULL;
+    freeaddrinfo(results);
+
+    if (optimistic) {
+        request->pending = SOCKS_PENDING_CONNECT;
+        return dest_sockfd;
+    }
+
+    if (breaker != NULL)
+        socks_breaker_report(breaker, address, port, SOCKS_REP_SUCCEEDED);
+    if ((socks_code = sendn(client_sockfd, res_template, sizeof(res_template), 0)) < 0) {
+        close(dest_sockfd);
+        return socks_code;
+    }
 
     return dest_sockfd;
 
+    report_failure:
+    if (breaker != NULL)
+        socks_breaker_report(breaker, address, port, res_template[1]);
+    destination_failed:
+    // after an optimistic reply all that's left is closing the client
+    if (!replied)
+        sendn(client_sockfd, res_template, sizeof(res_template), 0);
+    return SOCKS_DESTINATION_UNREACHABLE;
+
     invalid_auth:
     sendn(client_sockfd, &version, 1, 0);
     sendn(client_sockfd, &no_method, 1, 0);
@@ -374,130 +659,144 @@ int socks_establish_connection(int client_sockfd, int timeout, struct addrinfo *
     sendn(client_sockfd, res_template, sizeof(res_template), 0);
     return SOCKS_INVALID_ADDRESS_TYPE;
 
-    req_invalid_version:
+    general_failure:
     res_template[1] = SOCKS_REP_GENERAL_FAILURE;
     sendn(client_sockfd, res_template, sizeof(res_template), 0);
-    return SOCKS_INVALID_VERSION;
-
-    host_unreachable:
-    res_template[1] = SOCKS_REP_HOST_UNREACHABLE;
-    sendn(client_sockfd, res_template, sizeof(res_template), 0);
-    return SOCKS_DESTINATION_UNREACHABLE;
-
-    network_unreachable:
-    res_template[1] = SOCKS_REP_NETWORK_UNREACHABLE;
-    sendn(client_sockfd, res_template, sizeof(res_template), 0);
     return SOCKS_DESTINATION_UNREACHABLE;
 
-    connection_refused:
-    res_template[1] = SOCKS_REP_CONNECTION_REFUSED;
+    req_invalid_version:
+    res_template[1] = SOCKS_REP_GENERAL_FAILURE;
     sendn(client_sockfd, res_template, sizeof(res_template), 0);
-    return SOCKS_DESTINATION_UNREACHABLE;
+    return SOCKS_INVALID_VERSION;
 
 }
 
-// NOTE: buffer has to be freed by the caller
-// content_length is set to -1 when using chunked encoding, and set to 0 when there is no body.
-// otherwise its set to the length of the body
-int socks_read_http_header(int sockfd, int timeout, char **buffer, size_t *length, ssize_t *content_length) {
-    // NOTE: these are to remain hardcoded
-    size_t current_size = 128;
-    unsigned int jump = 32;
-
-    *length = 0;
-    *buffer = calloc(1, current_size); 
-    char *current_ptr = *buffer;
-
-    // 3 previous  current window
-    // V           V
-    // +++         +++...+++
-    char *window = calloc(1, 3 + jump);
-    memset(window, 1, 3);
-    char *end;
-    int bytes_read;
-
-    do {
-        bytes_read = recvn(sockfd, window + 3, jump, timeout, 1, MSG_PEEK);
-        if (bytes_read < 0) {
-            free(*buffer);
-            free(window);
-            return bytes_read;
-        }
-        end = memmem(window, 3 + jump, "\r\n\r\n", 4);
-        memcpy(window, window + bytes_read, 3);
-        if (end != NULL)
-            bytes_read = end - window + 1;
-        
-
-        *length += bytes_read;
-        while (*length >= current_size) {
-            current_size *= 2;
-            *buffer = realloc(*buffer, current_size);
-        }
-        current_ptr = *buffer + *length - bytes_read;
-
-        int status = recvn(sockfd, current_ptr, (unsigned int)bytes_read, timeout, 0, 0);
-        if (status < 0) {
-            free(*buffer);
-            free(window);
-            return status;
-        }
-        //char *temp = malloc(*length + 1);
-        //memcpy(temp, *buffer, *length);
-        //temp[*length] = 0;
-        //printf("%s - end\n\n", temp);
-        //char *temp2 = malloc(jump + 4);
-        //memcpy(temp2, window, jump + 3);
-        //temp2[jump + 3] = 0;
-        //debug_print(temp2);
-        //printf("\n\n\n");
-    } while (end == NULL && *length <= MAX_HTTP_HEADER_SIZE);
-    
-    if (*length > MAX_HTTP_HEADER_SIZE) {
-        free(*buffer);
-        free(window);
+// looks at the complete header starting at start in buffer. content_length is set to the body length it announces
+// (RFC 9112 6.3): SOCKS_LENGTH_CHUNKED, SOCKS_LENGTH_UNTIL_CLOSE for a response without framing, 0 when there is
+// no body, otherwise the length. what depends on the request (responses to HEAD or CONNECT) is left to the caller
+int socks_parse_http_header(struct socks_buffer *buffer, size_t start, ssize_t *content_length) {
+    if (buffer->length - start > MAX_HTTP_HEADER_SIZE)
         return SOCKS_EXCEEDED_MAX_BUFFER_SIZE;
-    }
-
-    *buffer = realloc(*buffer, *length + 1);
-    (*buffer)[*length] = 0;
-
-    free(window);
 
-    char *header;
-    *content_length = 0;
-    if ((header = strstr(*buffer, "chunked")) != NULL) {
-        while (*(--header) != '\r') {
-            if (header == *buffer) {
-                free(*buffer);
-                return SOCKS_INVALID_HTTP_SYNTAX;
-            }
-        }
-        if (strncasecmp(header, "\r\nTransfer-Encoding:", 18) == 0) {
-            *content_length = -1;
+    // terminate the header for the string functions below, the body overwrites it
+    if (socks_buffer_reserve(buffer, 1) == NULL)
+        return SOCKS_SPILL_FAILED;
+    char *message = buffer->data + start;
+    message[buffer->length - start] = 0;
+
+    size_t length = buffer->length - start;
+    if (memchr(message, 0, length) != NULL)
+        return SOCKS_INVALID_HTTP_SYNTAX;
+    char response = strncmp(message, "HTTP/", 5) == 0;
+    if (response) {
+        int status = socks_http_status(message, length);
+        if (status < 100)
+            return SOCKS_INVALID_HTTP_SYNTAX;
+        // never have a body, whatever the fields say
+        if (status / 100 == 1 || status == 204 || status == 304) {
+            *content_length = 0;
             return SOCKS_OK;
         }
     }
-    if ((header = strcasestr(*buffer, "\r\nContent-Length:")) != NULL) {
-        for (char *i = header + 17; *i != '\r'; ++i) {
-            if (i == *buffer + *length) {
-                free(*buffer);
+
+    char transfer_encoding = 0, chunked = 0;
+    ssize_t announced_length = -1;
+    for (char *line = strstr(message, "\r\n") + 2; *line != '\r'; line = strstr(line, "\r\n") + 2) {
+        char *colon = strchr(line, ':');
+        char *line_end = strstr(line, "\r\n");
+        // whitespace before the colon or folded lines could be read differently by the destination
+        if (colon == NULL || colon > line_end || colon == line || colon[-1] == ' ' || colon[-1] == '\t'
+                || *line == ' ' || *line == '\t')
+            return SOCKS_INVALID_HTTP_SYNTAX;
+
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t')
+            ++value;
+        char *value_end = line_end;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            --value_end;
+
+        if (colon - line == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+            // only the final coding matters, and only if it's chunked the length is known
+            char *coding = value_end;
+            while (coding > value && coding[-1] != ',' && coding[-1] != ' ' && coding[-1] != '\t')
+                --coding;
+            transfer_encoding = 1;
+            chunked = value_end - coding == 7 && strncasecmp(coding, "chunked", 7) == 0;
+        } else if (colon - line == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+            if (value == value_end)
                 return SOCKS_INVALID_HTTP_SYNTAX;
+            ssize_t parsed = 0;
+            for (char *i = value; i < value_end; ++i) {
+                if (*i > '9' || *i < '0' || parsed > (SSIZE_MAX - 9) / 10)
+                    return SOCKS_INVALID_HTTP_SYNTAX;
+                parsed = parsed * 10 + *i - '0';
             }
-            if (*i == ' ')
-                continue;
-            if (*i > '9' || *i < '0') {
-                free(*buffer);
+            if (announced_length != -1 && announced_length != parsed)
                 return SOCKS_INVALID_HTTP_SYNTAX;
-            }
-            *content_length *= 10;
-            *content_length += *i - '0';
+            announced_length = parsed;
         }
     }
 
+    // transfer encoding overrides content length
+    if (transfer_encoding && chunked)
+        *content_length = SOCKS_LENGTH_CHUNKED;
+    else if (transfer_encoding && response)
+        *content_length = SOCKS_LENGTH_UNTIL_CLOSE;
+    else if (transfer_encoding)
+        return SOCKS_INVALID_HTTP_SYNTAX;
+    else if (announced_length != -1)
+        *content_length = announced_length;
+    else
+        *content_length = response ? SOCKS_LENGTH_UNTIL_CLOSE : 0;
     return SOCKS_OK;
 }
 
+// takes what has arrived of a header out of the socket without blocking, but never more than the header itself.
+// the header starts at start in buffer, bytes of it taken by earlier calls are already there.
+// returns 1 once the header is complete (content_length set as by socks_parse_http_header), 0 while more has to arrive
+int socks_take_http_header(int sockfd, struct socks_buffer *buffer, size_t start, ssize_t *content_length) {
+    // NOTE: these are to remain hardcoded
+    unsigned int jump = 512;
+
+    // peek at what arrived, only take the bytes up to the end of the header out of the socket
+    char *end = NULL;
+    while (end == NULL) {
+        if (buffer->length - start > MAX_HTTP_HEADER_SIZE)
+            return SOCKS_EXCEEDED_MAX_BUFFER_SIZE;
+
+        char *window = socks_buffer_reserve(buffer, jump);
+        if (window == NULL)
+            return SOCKS_SPILL_FAILED;
+
+        ssize_t bytes_read = recv(sockfd, window, jump, MSG_PEEK | MSG_DONTWAIT);
+        if (bytes_read == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                return SOCKS_SYSTEM_INTERRUPT;
+            return socks_io_failed("recv failed");
+        }
+        if (bytes_read == 0)
+            return SOCKS_CONNECTION_TERMINATED;
+
+        // the terminator can straddle the previous window
+        size_t search_start = buffer->length - start >= 3 ? buffer->length - 3 : start;
+        end = memmem(buffer->data + search_start, buffer->length + bytes_read - search_start, "\r\n\r\n", 4);
+        if (end != NULL)
+            bytes_read = end + 4 - window;
+
+        // the peeked bytes are there already, no waiting
+        int status = recvn(sockfd, window, bytes_read, 0, 0, 0);
+        if (status < 0)
+            return status;
+        socks_buffer_commit(buffer, bytes_read);
+    }
+
+    int status = socks_parse_http_header(buffer, start, content_length);
+    return status < 0 ? status : 1;
+}
+
 char hex_to_int(char c) {
     if (c >= '0' && c <= '9')
         return c - '0';
@@ -508,125 +807,279 @@ char hex_to_int(char c) {
     return -1;
 }
 
-int socks_read_http_body(int sockfd, int timeout, char **buffer, ssize_t content_length, size_t *length) {
-    *length = 0;
-    if (content_length == 0) {
-        *buffer = NULL;
-        return SOCKS_OK;
-    }
+// receives n bytes into the buffer piece by piece, pages of a spilled buffer are dropped once filled
+int recv_into_buffer(int sockfd, struct socks_buffer *buffer, size_t n, int timeout) {
+    while (n > 0) {
+        size_t piece = n < SOCKS_BUFFER_CHUNK_SIZE ? n : SOCKS_BUFFER_CHUNK_SIZE;
+        char *destination = socks_buffer_reserve(buffer, piece);
+        if (destination == NULL)
+            return SOCKS_SPILL_FAILED;
 
-    if (content_length > 0) {
-        *length = content_length;
-        if (*length > MAX_HTTP_BODY_SIZE)
-            return SOCKS_EXCEEDED_MAX_BUFFER_SIZE;
-        *buffer = malloc(content_length + 1);
-        int status = recvn(sockfd, *buffer, content_length, timeout, 0, 0);
-        if (status < 0) {
-            free(*buffer);
+        int status = recvn(sockfd, destination, piece, timeout, 0, 0);
+        if (status < 0)
             return status;
-        }
-        (*buffer)[*length] = 0;
-        return SOCKS_OK;
+        socks_buffer_commit(buffer, piece);
+        socks_buffer_evict(buffer, buffer->length - piece, piece);
+        n -= piece;
     }
+    return SOCKS_OK;
+}
 
-    // TODO: maybe refactor code below
-    // content_length == -1
-
-    unsigned int chunk_size;
-    size_t current_size = 128;
-    *buffer = malloc(current_size);
-    char *current_ptr = *buffer;
-    do {
-        chunk_size = 0;
-        char c = 0;
-        while (*length <= MAX_HTTP_BODY_SIZE) {
-            ++(*length);
-            while (*length >= current_size) {
-                current_size *= 2;
-                *buffer = realloc(*buffer, current_size);
-            }
-            current_ptr = *buffer + *length - 1;
-
-            int status = recvn(sockfd, current_ptr, 1, timeout, 0, 0);
-            if (status < 0) {
-                free(*buffer);
-                return status;
-            }
-
-            c = *current_ptr;
-            
-            if (c == '\r')
-                break;
+// NOTE: the body is appended to buffer, which is left to the caller to free (also on error)
+int socks_read_http_body(int sockfd, int timeout, struct socks_buffer *buffer, ssize_t content_length, size_t max_body_size) {
+    if (content_length == 0)
+        return SOCKS_OK;
 
-            char digit = hex_to_int(c);
+    if (content_length > 0) {
+        if (content_length > max_body_size)
+            return SOCKS_EXCEEDED_MAX_BUFFER_SIZE;
+        // size it once up front instead of doubling through a large body
+        if (socks_buffer_reserve(buffer, content_length) == NULL)
+            return SOCKS_SPILL_FAILED;
+        return recv_into_buffer(sockfd, buffer, content_length, timeout);
+    }
 
-            if (digit == -1) {
-                free(*buffer);
-                return SOCKS_INVALID_HTTP_SYNTAX;
-            }
+    // chunked or until close: the body state machine finds the end, the next message may follow right behind
+    // it, so a chunked body is peeked at first and only its own bytes are taken out of the socket
+    struct socks_body_state body;
+    socks_body_init(&body, content_length);
+    int flags = body.mode == SOCKS_BODY_CHUNKED ? MSG_PEEK : 0;
+    size_t start = buffer->length;
+    struct pollfd pollfds[1] = {{.fd = sockfd, .events = POLLIN}};
+    while (body.mode != SOCKS_BODY_NONE) {
+        if (buffer->length - start >= max_body_size)
+            return SOCKS_EXCEEDED_MAX_BUFFER_SIZE;
 
-            
-            chunk_size *= 16;
-            chunk_size += digit;
-        }
+        char *destination = socks_buffer_reserve(buffer, 16384);
+        if (destination == NULL)
+            return SOCKS_SPILL_FAILED;
 
-        if (*length > MAX_HTTP_BODY_SIZE) {
-            free(*buffer);
-            return SOCKS_EXCEEDED_MAX_BUFFER_SIZE;
+        int polled = poll(pollfds, 1, timeout);
+        if (polled == -1) {
+            if (errno == EINTR)
+                return SOCKS_SYSTEM_INTERRUPT;
+            return socks_io_failed("poll failed");
         }
+        if (polled == 0)
+            return SOCKS_TIMEOUT;
 
-        *length += 1 + chunk_size + 2;
-        while (*length >= current_size) {
-            current_size *= 2;
-            *buffer = realloc(*buffer, current_size);
+        ssize_t bytes_read = recv(sockfd, destination, 16384, flags);
+        if (bytes_read == -1) {
+            if (errno == EINTR)
+                return SOCKS_SYSTEM_INTERRUPT;
+            return socks_io_failed("recv failed");
         }
-        current_ptr = *buffer + *length - (1 + chunk_size + 2);
+        if (bytes_read == 0)
+            return body.mode == SOCKS_BODY_UNTIL_CLOSE ? SOCKS_OK : SOCKS_CONNECTION_TERMINATED;
 
-        int status = recvn(sockfd, current_ptr, 1 + chunk_size + 2, timeout, 0, 0);
-        if (status < 0) {
-            free(*buffer);
+        ssize_t taken = socks_body_consume(&body, destination, bytes_read);
+        if (taken < 0)
+            return taken;
+        int status;
+        if (flags & MSG_PEEK && (status = recvn(sockfd, destination, taken, timeout, 0, 0)) < 0)
             return status;
-        }
+        socks_buffer_commit(buffer, taken);
+        socks_buffer_evict(buffer, buffer->length - taken, taken);
+    }
 
-    } while (chunk_size != 0 && *length <= MAX_HTTP_BODY_SIZE);
+    return SOCKS_OK;
+}
 
-    if (*length > MAX_HTTP_BODY_SIZE) {
-        free(*buffer);
-        return SOCKS_EXCEEDED_MAX_BUFFER_SIZE;
+// sends as much of message from *sent on as the socket takes without blocking and advances *sent.
+// returns the number of bytes sent, 0 when the socket is full
+ssize_t socks_send_http_message(int sockfd, struct socks_buffer *message, size_t *sent) {
+    size_t start = *sent;
+    while (*sent < message->length) {
+        size_t piece = message->length - *sent < SOCKS_BUFFER_CHUNK_SIZE ? message->length - *sent : SOCKS_BUFFER_CHUNK_SIZE;
+        ssize_t bytes_sent = send(sockfd, message->data + *sent, piece, MSG_DONTWAIT);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return socks_io_failed("send failed");
+        }
+        socks_buffer_evict(message, *sent, bytes_sent);
+        *sent += bytes_sent;
     }
+    return *sent - start;
+}
 
-    *buffer = realloc(*buffer, *length + 1);
-    (*buffer)[*length] = 0;
+enum socks_chunk_states {
+    SOCKS_CHUNK_SIZE,
+    SOCKS_CHUNK_EXTENSION,
+    SOCKS_CHUNK_SIZE_LF,
+    SOCKS_CHUNK_DATA,
+    SOCKS_CHUNK_DATA_CR,
+    SOCKS_CHUNK_DATA_LF,
+    SOCKS_CHUNK_TRAILER_START,
+    SOCKS_CHUNK_TRAILER,
+    SOCKS_CHUNK_END_LF
+};
+
+// content_length as set by socks_parse_http_header
+void socks_body_init(struct socks_body_state *body, ssize_t content_length) {
+    body->chunk_state = SOCKS_CHUNK_SIZE;
+    body->remaining = 0;
+    if (content_length == 0)
+        body->mode = SOCKS_BODY_NONE;
+    else if (content_length > 0) {
+        body->mode = SOCKS_BODY_LENGTH;
+        body->remaining = content_length;
+    } else if (content_length == SOCKS_LENGTH_UNTIL_CLOSE)
+        body->mode = SOCKS_BODY_UNTIL_CLOSE;
+    else
+        body->mode = SOCKS_BODY_CHUNKED;
+}
 
-    return SOCKS_OK;
+// returns how many of the n bytes belong to the body, the mode drops to SOCKS_BODY_NONE once it ended
+ssize_t socks_body_consume(struct socks_body_state *body, const char *data, size_t n) {
+    if (body->mode == SOCKS_BODY_RAW || body->mode == SOCKS_BODY_UNTIL_CLOSE)
+        return n;
+    if (body->mode == SOCKS_BODY_LENGTH) {
+        size_t taken = n < body->remaining ? n : body->remaining;
+        body->remaining -= taken;
+        if (body->remaining == 0)
+            body->mode = SOCKS_BODY_NONE;
+        return taken;
+    }
+
+    size_t i = 0;
+    while (i < n && body->mode == SOCKS_BODY_CHUNKED) {
+        char c = data[i];
+        switch (body->chunk_state) {
+            case SOCKS_CHUNK_SIZE:
+                if (c == '\r')
+                    body->chunk_state = SOCKS_CHUNK_SIZE_LF;
+                else if (c == ';')
+                    body->chunk_state = SOCKS_CHUNK_EXTENSION;
+                else if (hex_to_int(c) == -1 || body->remaining > ((size_t)-1 >> 4))
+                    return SOCKS_INVALID_HTTP_SYNTAX;
+                else
+                    body->remaining = body->remaining * 16 + hex_to_int(c);
+                break;
+            case SOCKS_CHUNK_EXTENSION:
+                if (c == '\r')
+                    body->chunk_state = SOCKS_CHUNK_SIZE_LF;
+                break;
+            case SOCKS_CHUNK_SIZE_LF:
+                if (c != '\n')
+                    return SOCKS_INVALID_HTTP_SYNTAX;
+                body->chunk_state = body->remaining == 0 ? SOCKS_CHUNK_TRAILER_START : SOCKS_CHUNK_DATA;
+                break;
+            case SOCKS_CHUNK_DATA: {
+                size_t taken = n - i < body->remaining ? n - i : body->remaining;
+                body->remaining -= taken;
+                if (body->remaining == 0)
+                    body->chunk_state = SOCKS_CHUNK_DATA_CR;
+                i += taken;
+                continue;
+            }
+            case SOCKS_CHUNK_DATA_CR:
+                if (c != '\r')
+                    return SOCKS_INVALID_HTTP_SYNTAX;
+                body->chunk_state = SOCKS_CHUNK_DATA_LF;
+                break;
+            case SOCKS_CHUNK_DATA_LF:
+                if (c != '\n')
+                    return SOCKS_INVALID_HTTP_SYNTAX;
+                body->chunk_state = SOCKS_CHUNK_SIZE;
+                break;
+            case SOCKS_CHUNK_TRAILER_START:
+                body->chunk_state = c == '\r' ? SOCKS_CHUNK_END_LF : SOCKS_CHUNK_TRAILER;
+                break;
+            case SOCKS_CHUNK_TRAILER:
+                if (c == '\n')
+                    body->chunk_state = SOCKS_CHUNK_TRAILER_START;
+                break;
+            case SOCKS_CHUNK_END_LF:
+                if (c != '\n')
+                    return SOCKS_INVALID_HTTP_SYNTAX;
+                body->mode = SOCKS_BODY_NONE;
+                break;
+        }
+        ++i;
+    }
+    return i;
 }
 
-int socks_read_http_message(int sockfd, int timeout, char **buffer, size_t *length) {
-    int status;
+// forwards what is available of the body (or the raw stream) right now, but at most budget bytes. what dest_sockfd
+// doesn't take without blocking is appended to pending, which has to be empty and is to be sent before the next call.
+// returns the number of bytes taken from sockfd, 0 if nothing was ready
+ssize_t socks_relay_body(int sockfd, int dest_sockfd, struct socks_body_state *body, size_t budget, struct socks_buffer *pending) {
+    char buffer[16384];
+    size_t n = budget < sizeof(buffer) ? budget : sizeof(buffer);
+    if (body->mode == SOCKS_BODY_LENGTH && n > body->remaining)
+        n = body->remaining;
+
+    // a chunked body has to be looked at first, the next message may follow right behind it
+    int flags = body->mode == SOCKS_BODY_CHUNKED ? MSG_PEEK | MSG_DONTWAIT : MSG_DONTWAIT;
+    ssize_t bytes_read = recv(sockfd, buffer, n, flags);
+    if (bytes_read == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno == EINTR)
+            return SOCKS_SYSTEM_INTERRUPT;
+        return socks_io_failed("recv failed");
+    }
+    if (bytes_read == 0)
+        return SOCKS_CONNECTION_TERMINATED;
 
-    size_t header_length;
-    ssize_t content_length;
-    char *header;
-    if ((status = socks_read_http_header(sockfd, timeout, &header, &header_length, &content_length)) != SOCKS_OK)
-        return status;
+    ssize_t taken = socks_body_consume(body, buffer, bytes_read);
+    if (taken < 0)
+        return taken;
 
-    size_t body_length;
-    char *body;
-    if ((status = socks_read_http_body(sockfd, timeout, &body, content_length, &body_length)) != SOCKS_OK)
+    int status;
+    if (flags & MSG_PEEK && (status = recvn(sockfd, buffer, taken, 0, 0, 0)) < 0)
         return status;
 
-    *length = header_length + body_length;
-    *buffer = malloc(header_length + body_length + 1);
-    memcpy(*buffer, header, header_length);
-    memcpy(*buffer + header_length, body, body_length);
-    (*buffer)[*length] = 0;
+    ssize_t sent = send(dest_sockfd, buffer, taken, MSG_DONTWAIT);
+    if (sent == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return socks_io_failed("send failed");
+        sent = 0;
+    }
+    if (sent < taken) {
+        char *tail = socks_buffer_reserve(pending, taken - sent);
+        if (tail == NULL)
+            return SOCKS_SPILL_FAILED;
+        memcpy(tail, buffer + sent, taken - sent);
+        socks_buffer_commit(pending, taken - sent);
+    }
+    return taken;
+}
 
-    free(header);
-    free(body);
+// NOTE: the helpers below look at a header as taken by socks_take_http_header, length may include a body
+
+// the status code of a response, -1 for a request
+int socks_http_status(const char *header, size_t length) {
+    // HTTP/1.1 101 Switching Protocols
+    if (length < 12 || strncmp(header, "HTTP/", 5) != 0 || header[8] != ' ')
+        return -1;
+    int status = 0;
+    for (unsigned int i = 9; i < 12; ++i) {
+        if (header[i] < '0' || header[i] > '9')
+            return -1;
+        status = status * 10 + header[i] - '0';
+    }
+    return status;
+}
 
-    return SOCKS_OK;
+char socks_http_is_method(const char *header, size_t length, const char *method) {
+    size_t method_length = strlen(method);
+    return length > method_length && strncmp(header, method, method_length) == 0 && header[method_length] == ' ';
 }
 
-int socks_send_http_message(int sockfd, const char *buffer, size_t length) {
-    return sendn(sockfd, buffer, length, 0);
+// whether a header field called name (case insensitive) is present
+char socks_http_has_header(const char *header, size_t length, const char *name) {
+    const char *end = memmem(header, length, "\r\n\r\n", 4);
+    if (end == NULL)
+        return 0;
+    size_t name_length = strlen(name);
+    for (const char *line = memmem(header, end - header, "\r\n", 2); line != NULL && line < end;
+            line = memmem(line + 2, end + 2 - (line + 2), "\r\n", 2)) {
+        if (end - (line + 2) > name_length && strncasecmp(line + 2, name, name_length) == 0 && line[2 + name_length] == ':')
+            return 1;
+    }
+    return 0;
 }
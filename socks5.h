@@ -1,13 +1,16 @@
 #ifndef SOCKS5_H
 #define SOCKS5_H
 
-#define __USE_GNU
 #include <netdb.h>
+#include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <poll.h>
 
+#include "socks5_buffer.h"
+#include "socks5_breaker.h"
+
 #define SOCKS_VERSION 0x05
 
 enum socks_error_codes {
@@ -21,7 +24,11 @@ enum socks_error_codes {
     SOCKS_EXCEEDED_MAX_BUFFER_SIZE = -7,
     SOCKS_TIMEOUT = -8,
     SOCKS_INVALID_HTTP_SYNTAX = -9,
-    SOCKS_SYSTEM_INTERRUPT = -10
+    SOCKS_SYSTEM_INTERRUPT = -10,
+    SOCKS_SPILL_FAILED = -11,
+    SOCKS_OVERLOADED = -12,
+    SOCKS_TLS_FAILED = -13,
+    SOCKS_EDITOR_FAILED = -14
 };
 
 enum socks_auth_methods {
@@ -53,6 +60,48 @@ enum socks_replies {
     SOCKS_REP_ADDRESS_TYPE_NOT_SUPPORTED = 0x08,
 };
 
+// replied to optimistically, the destination is still being looked up or connected to
+enum socks_pending_states {
+    SOCKS_PENDING_NONE,
+    SOCKS_PENDING_CONNECT,
+    SOCKS_PENDING_RESOLVE
+};
+
+struct socks_resolve;
+
+// filled in by socks_establish_connection from the client's request
+struct socks_request {
+    unsigned char command;
+    unsigned char atyp;
+    char host[256];
+    unsigned short port;
+    struct sockaddr_in dest_addr; // sin_family is AF_UNSPEC until resolved
+    char pending; // socks_pending_states
+    struct socks_resolve *resolve; // while SOCKS_PENDING_RESOLVE, of this process only (not handed off)
+};
+
+// requests a flow may have outstanding before the client is paused
+#define SOCKS_PIPELINE_DEPTH 16
+
+// content lengths without a number (see socks_parse_http_header)
+#define SOCKS_LENGTH_CHUNKED -1
+#define SOCKS_LENGTH_UNTIL_CLOSE -2
+
+enum socks_body_modes {
+    SOCKS_BODY_NONE, // no body pending, the next bytes are a header
+    SOCKS_BODY_LENGTH,
+    SOCKS_BODY_CHUNKED,
+    SOCKS_BODY_UNTIL_CLOSE, // a response without framing ends with the connection
+    SOCKS_BODY_RAW // the connection left http (upgrade or tunnel), everything is relayed as is
+};
+
+// NOTE: tracks a body that is relayed in pieces instead of being read whole
+struct socks_body_state {
+    unsigned char mode;
+    unsigned char chunk_state;
+    size_t remaining; // bytes left of the body or of the current chunk
+};
+
 //enum socks_poll_flags {
 //    SOCKS_CPOLLIN = POLLIN,
 //    SOCKS_CPOLLRDNORM = POLLRDNORM,
@@ -87,14 +136,28 @@ enum socks_replies {
 //    long events, revents;
 //};
 
+int recvn(int sockfd, void *buffer, size_t n, int timeout, char accept_less, int recv_flags);
+int sendn(int sockfd, const void *message, size_t n, int flags);
 const char *socks_strerror(int error);
+unsigned int socks_hash_host(const char *host, unsigned short port);
 int socks_listen(unsigned short port, unsigned int backlog);
 int socks_accept(int sockfd, int timeout, struct sockaddr *client_addr);
-int socks_establish_connection(int client_sockfd, int timeout, struct addrinfo *dest);
-int socks_read_http_header(int sockfd, int timeout, char **buffer, size_t *length, ssize_t *content_length);
-int socks_read_http_body(int sockfd, int timeout, char **buffer, ssize_t content_length, size_t *length);
-int socks_read_http_message(int sockfd, int timeout, char **buffer, size_t *length);
-int socks_send_http_message(int sockfd, const char *buffer, size_t length);
+int socks_establish_connection(int client_sockfd, int timeout, int connect_timeout, char optimistic,
+        struct socks_breaker *breaker, struct addrinfo *dest, struct socks_request *request);
+int socks_complete_connection(int dest_sockfd, char timed_out, struct socks_breaker *breaker, struct socks_request *request);
+int socks_resolve_start(struct socks_request *request);
+int socks_resolve_finish(char timed_out, struct socks_breaker *breaker, struct socks_request *request);
+void socks_resolve_cancel(struct socks_request *request);
+int socks_parse_http_header(struct socks_buffer *buffer, size_t start, ssize_t *content_length);
+int socks_take_http_header(int sockfd, struct socks_buffer *buffer, size_t start, ssize_t *content_length);
+int socks_read_http_body(int sockfd, int timeout, struct socks_buffer *buffer, ssize_t content_length, size_t max_body_size);
+ssize_t socks_send_http_message(int sockfd, struct socks_buffer *message, size_t *sent);
+void socks_body_init(struct socks_body_state *body, ssize_t content_length);
+ssize_t socks_body_consume(struct socks_body_state *body, const char *data, size_t n);
+ssize_t socks_relay_body(int sockfd, int dest_sockfd, struct socks_body_state *body, size_t budget, struct socks_buffer *pending);
+int socks_http_status(const char *header, size_t length);
+char socks_http_is_method(const char *header, size_t length, const char *method);
+char socks_http_has_header(const char *header, size_t length, const char *name);
 //int socks_poll(struct socks_pollfd *fds, nfds_t nfds, int timeout);
 
 #endif // SOCKS5_H
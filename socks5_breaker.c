@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "socks5_breaker.h"
+#include "socks5.h"
+
+struct socks_breaker *socks_breaker_create(void) {
+    return calloc(1, sizeof(struct socks_breaker));
+}
+
+void socks_breaker_free(struct socks_breaker *breaker) {
+    free(breaker);
+}
+
+static struct socks_breaker_entry *socks_breaker_slot(struct socks_breaker *breaker, const char *host, unsigned short port) {
+    return &breaker->entries[socks_hash_host(host, port) & (SOCKS_BREAKER_SIZE - 1)];
+}
+
+static char socks_breaker_matches(const struct socks_breaker_entry *entry, const char *host, unsigned short port) {
+    return entry->reply != SOCKS_REP_SUCCEEDED && entry->port == port && strcmp(entry->host, host) == 0;
+}
+
+static char socks_breaker_passed(const struct timespec *until, const struct timespec *now) {
+    return now->tv_sec > until->tv_sec || (now->tv_sec == until->tv_sec && now->tv_nsec >= until->tv_nsec);
+}
+
+static void socks_breaker_after(struct timespec *until, const struct timespec *now, int ms) {
+    until->tv_sec = now->tv_sec + ms / 1000;
+    until->tv_nsec = now->tv_nsec + (ms % 1000) * 1000000L;
+    if (until->tv_nsec >= 1000000000L) {
+        ++until->tv_sec;
+        until->tv_nsec -= 1000000000L;
+    }
+}
+
+// returns SOCKS_REP_SUCCEEDED when the destination should be tried, otherwise the reply to send right away
+unsigned char socks_breaker_check(struct socks_breaker *breaker, const char *host, unsigned short port) {
+    struct socks_breaker_entry *entry = socks_breaker_slot(breaker, host, port);
+    if (!socks_breaker_matches(entry, host, port))
+        return SOCKS_REP_SUCCEEDED;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    switch (entry->state) {
+        case SOCKS_BREAKER_CLOSED:
+            if (socks_breaker_passed(&entry->until, &now))
+                return SOCKS_REP_SUCCEEDED;
+            return entry->reply;
+        case SOCKS_BREAKER_OPEN:
+            if (!socks_breaker_passed(&entry->until, &now))
+                return entry->reply;
+            // let a single probe through, its report decides where the breaker goes
+            entry->state = SOCKS_BREAKER_HALF_OPEN;
+            socks_breaker_after(&entry->until, &now, entry->backoff);
+            return SOCKS_REP_SUCCEEDED;
+        default:
+            // a probe that never reported back (interrupted handshake) is replaced after another backoff
+            if (!socks_breaker_passed(&entry->until, &now))
+                return entry->reply;
+            socks_breaker_after(&entry->until, &now, entry->backoff);
+            return SOCKS_REP_SUCCEEDED;
+    }
+}
+
+// reply is what the client got for a connect that was actually tried
+void socks_breaker_report(struct socks_breaker *breaker, const char *host, unsigned short port, unsigned char reply) {
+    struct socks_breaker_entry *entry = socks_breaker_slot(breaker, host, port);
+    if (reply == SOCKS_REP_SUCCEEDED) {
+        if (socks_breaker_matches(entry, host, port))
+            memset(entry, 0, sizeof(struct socks_breaker_entry));
+        return;
+    }
+
+    if (!socks_breaker_matches(entry, host, port)) {
+        memset(entry, 0, sizeof(struct socks_breaker_entry));
+        strcpy(entry->host, host);
+        entry->port = port;
+    }
+    entry->reply = reply;
+    ++entry->failures;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (entry->state == SOCKS_BREAKER_HALF_OPEN) {
+        entry->backoff = entry->backoff * 2 < breaker->max_backoff ? entry->backoff * 2 : breaker->max_backoff;
+        entry->state = SOCKS_BREAKER_OPEN;
+        socks_breaker_after(&entry->until, &now, entry->backoff);
+    } else if (breaker->failure_threshold != 0 && entry->failures >= breaker->failure_threshold) {
+        entry->backoff = breaker->backoff;
+        entry->state = SOCKS_BREAKER_OPEN;
+        socks_breaker_after(&entry->until, &now, entry->backoff);
+    } else
+        socks_breaker_after(&entry->until, &now, breaker->negative_ttl);
+}
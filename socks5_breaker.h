@@ -0,0 +1,40 @@
+#ifndef SOCKS5_BREAKER_H
+#define SOCKS5_BREAKER_H
+
+#include <time.h>
+
+// destinations tracked at once, a power of two
+#define SOCKS_BREAKER_SIZE 1024
+
+enum socks_breaker_states {
+    SOCKS_BREAKER_CLOSED, // connects go through
+    SOCKS_BREAKER_OPEN, // connects are refused with the cached reply until the backoff ran out
+    SOCKS_BREAKER_HALF_OPEN // one probe is on its way, everyone else still gets the cached reply
+};
+
+struct socks_breaker_entry {
+    char host[256];
+    unsigned short port;
+    unsigned char state;
+    unsigned char reply; // of the last failure, SOCKS_REP_SUCCEEDED when there is none
+    unsigned int failures; // in a row
+    int backoff; // ms the breaker stays open, doubles with every failed probe
+    struct timespec until; // the cached failure (closed) or the backoff (open) ends
+};
+
+// NOTE: direct mapped by destination like the rate limiter, a colliding destination replaces the entry.
+// the settings are copied from the config by the owner and apply from the next failure on
+struct socks_breaker {
+    unsigned int failure_threshold; // failures in a row that open the breaker, 0 disables it
+    int negative_ttl; // ms a single failure is answered from the cache
+    int backoff; // ms, first open period
+    int max_backoff;
+    struct socks_breaker_entry entries[SOCKS_BREAKER_SIZE];
+};
+
+struct socks_breaker *socks_breaker_create(void);
+void socks_breaker_free(struct socks_breaker *breaker);
+unsigned char socks_breaker_check(struct socks_breaker *breaker, const char *host, unsigned short port);
+void socks_breaker_report(struct socks_breaker *breaker, const char *host, unsigned short port, unsigned char reply);
+
+#endif // SOCKS5_BREAKER_H
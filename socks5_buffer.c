@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "socks5.h"
+#include "socks5_buffer.h"
+
+void socks_buffer_init(struct socks_buffer *buffer, size_t spill_threshold) {
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    buffer->spill_threshold = spill_threshold;
+    buffer->fd = -1;
+    buffer->path[0] = 0;
+}
+
+void socks_buffer_free(struct socks_buffer *buffer) {
+    if (buffer->fd == -1) {
+        free(buffer->data);
+    } else {
+        munmap(buffer->data, buffer->capacity);
+        close(buffer->fd);
+        unlink(buffer->path);
+    }
+    socks_buffer_init(buffer, buffer->spill_threshold);
+}
+
+// grows the temp file to capacity and maps it
+static int socks_buffer_map(struct socks_buffer *buffer, size_t capacity) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    capacity = (capacity + page_size - 1) & ~(page_size - 1);
+    if (capacity == 0)
+        capacity = page_size;
+
+    // allocate the blocks now, a full disk would otherwise surface as SIGBUS when writing to the mapping
+    if (posix_fallocate(buffer->fd, 0, capacity) != 0)
+        return SOCKS_SPILL_FAILED;
+
+    void *data;
+    if (buffer->data == NULL)
+        data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->fd, 0);
+    else
+        data = mremap(buffer->data, buffer->capacity, capacity, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED)
+        return SOCKS_SPILL_FAILED;
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return SOCKS_OK;
+}
+
+// moves the buffer into a temp file, no-op if it already lives there
+int socks_buffer_spill(struct socks_buffer *buffer) {
+    if (buffer->fd != -1)
+        return SOCKS_OK;
+
+    memcpy(buffer->path, SOCKS_BUFFER_TEMPLATE, sizeof(SOCKS_BUFFER_TEMPLATE));
+    int fd = mkstemp(buffer->path);
+    if (fd == -1)
+        return SOCKS_SPILL_FAILED;
+
+    char *heap_data = buffer->data;
+    size_t heap_capacity = buffer->capacity;
+    buffer->fd = fd;
+    buffer->data = NULL;
+    buffer->capacity = 0;
+
+    if (socks_buffer_map(buffer, heap_capacity) < 0) {
+        close(fd);
+        unlink(buffer->path);
+        buffer->fd = -1;
+        buffer->data = heap_data;
+        buffer->capacity = heap_capacity;
+        return SOCKS_SPILL_FAILED;
+    }
+
+    memcpy(buffer->data, heap_data, buffer->length);
+    free(heap_data);
+    return SOCKS_OK;
+}
+
+// NOTE: returns NULL if the buffer had to spill and couldn't
+char *socks_buffer_reserve(struct socks_buffer *buffer, size_t n) {
+    size_t needed = buffer->length + n;
+    if (needed <= buffer->capacity)
+        return buffer->data + buffer->length;
+
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 128;
+    while (capacity < needed)
+        capacity *= 2;
+
+    if (buffer->fd == -1 && capacity > buffer->spill_threshold && socks_buffer_spill(buffer) < 0)
+        return NULL;
+
+    if (buffer->fd == -1) {
+        buffer->data = realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    } else if (socks_buffer_map(buffer, capacity) < 0)
+        return NULL;
+
+    return buffer->data + buffer->length;
+}
+
+void socks_buffer_commit(struct socks_buffer *buffer, size_t n) {
+    buffer->length += n;
+}
+
+// trims the temp file to the message so another process can work on it.
+// NOTE: has to be followed by socks_buffer_remap before the buffer is touched again
+int socks_buffer_sync(struct socks_buffer *buffer) {
+    if (buffer->fd == -1)
+        return SOCKS_SPILL_FAILED;
+    if (ftruncate(buffer->fd, buffer->length) == -1)
+        return SOCKS_SPILL_FAILED;
+    return SOCKS_OK;
+}
+
+// maps the temp file again after it was changed by someone else, the length follows the file
+int socks_buffer_remap(struct socks_buffer *buffer) {
+    // editors commonly write a new file and rename it over the old one, so reopen by path
+    int fd = open(buffer->path, O_RDWR);
+    if (fd == -1)
+        return SOCKS_SPILL_FAILED;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        close(fd);
+        return SOCKS_SPILL_FAILED;
+    }
+
+    munmap(buffer->data, buffer->capacity);
+    close(buffer->fd);
+    buffer->fd = fd;
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    buffer->length = file_stat.st_size;
+
+    return socks_buffer_map(buffer, buffer->length);
+}
+
+// drops the resident pages of a spilled range, the data stays in the file
+void socks_buffer_evict(struct socks_buffer *buffer, size_t offset, size_t n) {
+    if (buffer->fd == -1 || n == 0)
+        return;
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page_size - 1);
+    size_t end = offset + n;
+    if (end > buffer->capacity)
+        end = buffer->capacity;
+    madvise(buffer->data + start, end - start, MADV_DONTNEED);
+}
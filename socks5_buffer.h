@@ -0,0 +1,30 @@
+#ifndef SOCKS5_BUFFER_H
+#define SOCKS5_BUFFER_H
+
+#include <stddef.h>
+
+#define SOCKS_BUFFER_TEMPLATE "/tmp/interceptor_request.XXXXXX"
+// bodies are received and sent in pieces of this size so a spilled buffer never has all of its pages resident
+#define SOCKS_BUFFER_CHUNK_SIZE (1 << 20)
+
+// NOTE: holds a message in memory until it grows past spill_threshold, then in an mmapped temp file.
+// data stays valid until the next reserve/spill/remap, the file is always capacity bytes long while spilled
+struct socks_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+    size_t spill_threshold;
+    int fd; // -1 while in memory
+    char path[sizeof(SOCKS_BUFFER_TEMPLATE)];
+};
+
+void socks_buffer_init(struct socks_buffer *buffer, size_t spill_threshold);
+void socks_buffer_free(struct socks_buffer *buffer);
+char *socks_buffer_reserve(struct socks_buffer *buffer, size_t n);
+void socks_buffer_commit(struct socks_buffer *buffer, size_t n);
+int socks_buffer_spill(struct socks_buffer *buffer);
+int socks_buffer_sync(struct socks_buffer *buffer);
+int socks_buffer_remap(struct socks_buffer *buffer);
+void socks_buffer_evict(struct socks_buffer *buffer, size_t offset, size_t n);
+
+#endif // SOCKS5_BUFFER_H
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "socks5.h"
+#include "socks5_udp.h"
+
+// stays well below the 64k limit of a single gso super-datagram
+#define SOCKS_UDP_MAX_GSO_BYTES 60000
+
+// NOTE: bound receives BND.ADDR and BND.PORT (6 bytes, network byte order) for the reply
+int socks_udp_open(int client_sockfd, unsigned char *bound) {
+    struct sockaddr_in local;
+    socklen_t local_length = sizeof(local);
+    if (getsockname(client_sockfd, (struct sockaddr*)&local, &local_length) == -1) {
+        perror("getsockname failed");
+        exit(1);
+    }
+    local.sin_port = 0;
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sockfd == -1) {
+        // out of descriptors or memory, only this association is refused
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            return SOCKS_OVERLOADED;
+        perror("socket failed");
+        exit(1);
+    }
+
+    // high packet rates need more than the default queue to absorb bursts between polls
+    int buffer_size = 1 << 20;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    if (bind(sockfd, (struct sockaddr*)&local, sizeof(local)) == -1) {
+        close(sockfd);
+        return SOCKS_DESTINATION_UNREACHABLE;
+    }
+
+    local_length = sizeof(local);
+    if (getsockname(sockfd, (struct sockaddr*)&local, &local_length) == -1) {
+        perror("getsockname failed");
+        exit(1);
+    }
+    memcpy(bound, &local.sin_addr, sizeof(struct in_addr));
+    memcpy(bound + sizeof(struct in_addr), &local.sin_port, sizeof(unsigned short));
+
+    return sockfd;
+}
+
+struct socks_udp_association *socks_udp_associate(int udp_sockfd, int client_sockfd, const struct socks_request *request) {
+    struct socks_udp_association *association = calloc(1, sizeof(struct socks_udp_association));
+    association->sockfd = udp_sockfd;
+
+    struct sockaddr_in peer;
+    socklen_t peer_length = sizeof(peer);
+    if (getpeername(client_sockfd, (struct sockaddr*)&peer, &peer_length) == -1) {
+        perror("getpeername failed");
+        exit(1);
+    }
+    association->client_ip = peer.sin_addr;
+    // DST.PORT holds the port the client is going to send from, 0 if it doesn't know yet
+    association->client_port = htons(request->port);
+
+#ifdef UDP_SEGMENT
+    int gso_size;
+    socklen_t gso_length = sizeof(gso_size);
+    association->gso = getsockopt(udp_sockfd, SOL_UDP, UDP_SEGMENT, &gso_size, &gso_length) == 0;
+#endif
+
+    association->slots = malloc(SOCKS_UDP_BATCH * SOCKS_UDP_SLOT_SIZE);
+    for (unsigned int i = 0; i < SOCKS_UDP_BATCH; ++i) {
+        association->in_iov[i].iov_base = association->slots + i * SOCKS_UDP_SLOT_SIZE + SOCKS_UDP_HEADROOM;
+        association->in_iov[i].iov_len = SOCKS_UDP_SLOT_SIZE - SOCKS_UDP_HEADROOM;
+        association->in_msgs[i].msg_hdr.msg_iov = &association->in_iov[i];
+        association->in_msgs[i].msg_hdr.msg_iovlen = 1;
+        association->in_msgs[i].msg_hdr.msg_name = &association->in_addrs[i];
+    }
+
+    return association;
+}
+
+void socks_udp_free(struct socks_udp_association *association) {
+    free(association->slots);
+    free(association);
+}
+
+static char socks_udp_resolve_expired(const struct timespec *expires, const struct timespec *now) {
+    return now->tv_sec > expires->tv_sec || (now->tv_sec == expires->tv_sec && now->tv_nsec >= expires->tv_nsec);
+}
+
+static int socks_udp_resolve(struct socks_udp_association *association, const char *host, struct sockaddr_in *out) {
+    struct socks_udp_resolved *entry = &association->resolved[socks_hash_host(host, 0) & (SOCKS_UDP_RESOLVE_CACHE_SIZE - 1)];
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (strcmp(entry->host, host) != 0 || socks_udp_resolve_expired(&entry->expires, &now)) {
+        struct addrinfo hints, *results;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        int status = getaddrinfo(host, NULL, &hints, &results);
+        // a resolver that is down right now says nothing about the host, only actual answers are cached
+        if (status == EAI_AGAIN || (status == EAI_SYSTEM && errno == EINTR))
+            return SOCKS_DESTINATION_UNREACHABLE;
+
+        memcpy(entry->host, host, strlen(host) + 1);
+        entry->failed = status != 0;
+        if (status == 0) {
+            entry->addr = ((struct sockaddr_in*)results->ai_addr)->sin_addr;
+            freeaddrinfo(results);
+        }
+        int ttl = entry->failed ? SOCKS_UDP_RESOLVE_NEGATIVE_TTL : SOCKS_UDP_RESOLVE_TTL;
+        entry->expires.tv_sec = now.tv_sec + ttl / 1000;
+        entry->expires.tv_nsec = now.tv_nsec + (ttl % 1000) * 1000000L;
+        if (entry->expires.tv_nsec >= 1000000000L) {
+            ++entry->expires.tv_sec;
+            entry->expires.tv_nsec -= 1000000000L;
+        }
+    }
+
+    if (entry->failed)
+        return SOCKS_DESTINATION_UNREACHABLE;
+    out->sin_addr = entry->addr;
+    return SOCKS_OK;
+}
+
+// strips the request header in place, returns the header length or a negative value if the datagram should be dropped
+static int socks_udp_decapsulate(struct socks_udp_association *association, unsigned char *datagram, size_t length, struct sockaddr_in *dest) {
+    // +----+------+------+----------+----------+----------+
+    // |RSV | FRAG | ATYP | DST.ADDR | DST.PORT |   DATA   |
+    // +----+------+------+----------+----------+----------+
+    if (length < 4 || datagram[2] != 0) // fragmentation is not supported, fragments are dropped
+        return SOCKS_INVALID_COMMAND;
+
+    memset(dest, 0, sizeof(struct sockaddr_in));
+    dest->sin_family = AF_INET;
+
+    if (datagram[3] == SOCKS_IPV4) {
+        if (length < SOCKS_UDP_IPV4_HEADER_SIZE)
+            return SOCKS_INVALID_ADDRESS_TYPE;
+        memcpy(&dest->sin_addr, datagram + 4, sizeof(struct in_addr));
+        memcpy(&dest->sin_port, datagram + 8, sizeof(unsigned short));
+        return SOCKS_UDP_IPV4_HEADER_SIZE;
+    }
+
+    if (datagram[3] == SOCKS_DOMAINNAME) {
+        unsigned char domain_length = length > 4 ? datagram[4] : 0;
+        if (domain_length == 0 || length < 5 + domain_length + 2)
+            return SOCKS_INVALID_ADDRESS_TYPE;
+
+        char host[256];
+        memcpy(host, datagram + 5, domain_length);
+        host[domain_length] = 0;
+        if (socks_udp_resolve(association, host, dest) < 0)
+            return SOCKS_DESTINATION_UNREACHABLE;
+        memcpy(&dest->sin_port, datagram + 5 + domain_length, sizeof(unsigned short));
+        return 5 + domain_length + 2;
+    }
+
+    return SOCKS_INVALID_ADDRESS_TYPE; // TODO: ipv6
+}
+
+static struct socks_udp_peer *socks_udp_peer_slot(struct socks_udp_association *association, const struct sockaddr_in *addr) {
+    unsigned int hash = (addr->sin_addr.s_addr ^ addr->sin_port) * 2654435761u;
+    return &association->peers[(hash >> 16) & (SOCKS_UDP_PEER_TABLE_SIZE - 1)];
+}
+
+static char socks_udp_same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// groups out_iov[first..count) into messages, consecutive datagrams of the same size going to the same
+// address become one gso send when the socket supports it. returns the number of messages
+static unsigned int socks_udp_build_messages(struct socks_udp_association *association, unsigned int first, unsigned int count) {
+    unsigned int message_count = 0;
+    for (unsigned int i = first; i < count;) {
+        size_t segment_size = association->out_iov[i].iov_len;
+        size_t total = segment_size;
+        unsigned int j = i + 1;
+        while (association->gso && j < count && j - i < SOCKS_UDP_MAX_SEGMENTS
+                && socks_udp_same_addr(&association->out_addrs[i], &association->out_addrs[j])
+                && association->out_iov[j].iov_len <= segment_size
+                && total + association->out_iov[j].iov_len <= SOCKS_UDP_MAX_GSO_BYTES) {
+            total += association->out_iov[j].iov_len;
+            ++j;
+            if (association->out_iov[j - 1].iov_len < segment_size) // only the last segment may be shorter
+                break;
+        }
+
+        struct msghdr *header = &association->out_msgs[message_count].msg_hdr;
+        memset(header, 0, sizeof(struct msghdr));
+        header->msg_name = &association->out_addrs[i];
+        header->msg_namelen = sizeof(struct sockaddr_in);
+        header->msg_iov = &association->out_iov[i];
+        header->msg_iovlen = j - i;
+
+#ifdef UDP_SEGMENT
+        if (j - i > 1) {
+            header->msg_control = association->out_control[message_count];
+            header->msg_controllen = CMSG_SPACE(sizeof(unsigned short));
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(header);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+            unsigned short gso_size = segment_size;
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+#endif
+
+        ++message_count;
+        i = j;
+    }
+    return message_count;
+}
+
+static int socks_udp_send_batch(struct socks_udp_association *association, unsigned int count) {
+    unsigned int message_count = socks_udp_build_messages(association, 0, count);
+    unsigned int sent = 0;
+    while (sent < message_count) {
+        int status = sendmmsg(association->sockfd, association->out_msgs + sent, message_count - sent, MSG_DONTWAIT);
+        if (status == -1) {
+            if (errno == EINTR)
+                return SOCKS_SYSTEM_INTERRUPT;
+            if ((errno == EIO || errno == EINVAL) && association->gso) {
+                // the device can't segment, fall back to one datagram per message
+                association->gso = 0;
+                unsigned int first = association->out_msgs[sent].msg_hdr.msg_iov - association->out_iov;
+                message_count = socks_udp_build_messages(association, first, count);
+                sent = 0;
+                continue;
+            }
+            if (errno == EBADF || errno == EFAULT || errno == ENOTSOCK) {
+                perror("sendmmsg failed");
+                exit(1);
+            }
+            // full send buffer or an icmp error: udp gives no delivery guarantee, drop the message
+            ++sent;
+            continue;
+        }
+        for (int i = 0; i < status; ++i)
+            association->datagrams_out += association->out_msgs[sent + i].msg_hdr.msg_iovlen;
+        sent += status;
+    }
+    return SOCKS_OK;
+}
+
+// relays at most max_batches batches of datagrams in both directions, returns the number of datagrams received
+int socks_udp_relay(struct socks_udp_association *association, unsigned int max_batches) {
+    int relayed = 0;
+    for (unsigned int batch = 0; batch < max_batches; ++batch) {
+        for (unsigned int i = 0; i < SOCKS_UDP_BATCH; ++i) {
+            association->in_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            association->in_msgs[i].msg_hdr.msg_flags = 0;
+        }
+
+        int received = recvmmsg(association->sockfd, association->in_msgs, SOCKS_UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                return SOCKS_SYSTEM_INTERRUPT;
+            if (errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH)
+                continue;
+            perror("recvmmsg failed");
+            exit(1);
+        }
+
+        unsigned int out_count = 0;
+        for (int i = 0; i < received; ++i) {
+            unsigned char *payload = association->in_iov[i].iov_base;
+            size_t length = association->in_msgs[i].msg_len;
+            struct sockaddr_in *from = &association->in_addrs[i];
+
+            if (association->in_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                continue;
+            ++association->datagrams_in;
+
+            char from_client = from->sin_addr.s_addr == association->client_ip.s_addr
+                && (association->client_port == 0 || association->client_port == from->sin_port);
+
+            if (from_client) {
+                int header_length = socks_udp_decapsulate(association, payload, length, &association->out_addrs[out_count]);
+                if (header_length < 0)
+                    continue;
+                association->client_port = from->sin_port;
+                association->out_iov[out_count].iov_base = payload + header_length;
+                association->out_iov[out_count].iov_len = length - header_length;
+                association->bytes_in += length - header_length;
+                struct socks_udp_peer *peer = socks_udp_peer_slot(association, &association->out_addrs[out_count]);
+                peer->addr = association->out_addrs[out_count].sin_addr;
+                peer->port = association->out_addrs[out_count].sin_port;
+            } else {
+                if (association->client_port == 0) // no way to tell the client yet
+                    continue;
+                // anyone who can reach the relay port could inject into the association otherwise
+                struct socks_udp_peer *peer = socks_udp_peer_slot(association, from);
+                if (peer->port != from->sin_port || peer->addr.s_addr != from->sin_addr.s_addr)
+                    continue;
+                // the headroom in front of the payload takes the reply header, no copy of the data
+                unsigned char *header = payload - SOCKS_UDP_IPV4_HEADER_SIZE;
+                header[0] = 0;
+                header[1] = 0;
+                header[2] = 0;
+                header[3] = SOCKS_IPV4;
+                memcpy(header + 4, &from->sin_addr, sizeof(struct in_addr));
+                memcpy(header + 8, &from->sin_port, sizeof(unsigned short));
+
+                struct sockaddr_in *to = &association->out_addrs[out_count];
+                memset(to, 0, sizeof(struct sockaddr_in));
+                to->sin_family = AF_INET;
+                to->sin_addr = association->client_ip;
+                to->sin_port = association->client_port;
+                association->out_iov[out_count].iov_base = header;
+                association->out_iov[out_count].iov_len = length + SOCKS_UDP_IPV4_HEADER_SIZE;
+                association->bytes_out += length;
+            }
+            ++out_count;
+        }
+
+        int status = socks_udp_send_batch(association, out_count);
+        if (status < 0)
+            return status;
+
+        relayed += received;
+        if (received < SOCKS_UDP_BATCH)
+            break;
+    }
+    return relayed;
+}
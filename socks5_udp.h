@@ -0,0 +1,74 @@
+#ifndef SOCKS5_UDP_H
+#define SOCKS5_UDP_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "socks5.h"
+
+// datagrams moved per recvmmsg/sendmmsg call
+#define SOCKS_UDP_BATCH 32
+// largest datagram relayed (payload + encapsulation header), bigger ones are dropped
+#define SOCKS_UDP_SLOT_SIZE 4096
+// UDP_MAX_SEGMENTS in the kernel
+#define SOCKS_UDP_MAX_SEGMENTS 64
+// room in front of every slot for the encapsulation header of a reply (ipv4 only for now)
+#define SOCKS_UDP_HEADROOM 16
+#define SOCKS_UDP_IPV4_HEADER_SIZE 10
+// DOMAINNAME destinations remembered per association, a power of two
+#define SOCKS_UDP_RESOLVE_CACHE_SIZE 16
+// ms an answer is reused, and ms a failed lookup is answered from the cache
+#define SOCKS_UDP_RESOLVE_TTL 60000
+#define SOCKS_UDP_RESOLVE_NEGATIVE_TTL 5000
+// destinations the client sent to, replies are only relayed from these. a power of two
+#define SOCKS_UDP_PEER_TABLE_SIZE 256
+
+struct socks_udp_resolved {
+    char host[256]; // empty when the entry is unused
+    char failed;
+    struct in_addr addr;
+    struct timespec expires;
+};
+
+struct socks_udp_peer {
+    struct in_addr addr;
+    unsigned short port; // network byte order, 0 when the entry is unused
+};
+
+struct socks_udp_association {
+    int sockfd;
+
+    // datagrams coming from the client are recognized by address, the port is learned
+    // from the request or from the first datagram when the client didn't know it yet
+    struct in_addr client_ip;
+    unsigned short client_port; // network byte order, 0 when not known yet
+    char gso; // UDP_SEGMENT usable on this socket
+
+    // NOTE: direct mapped by host, lookups still block the loop on a miss but a host that doesn't
+    // resolve costs one lookup per negative ttl instead of one per datagram
+    struct socks_udp_resolved resolved[SOCKS_UDP_RESOLVE_CACHE_SIZE];
+    // NOTE: direct mapped by address and port, a destination pushed out by another one has its
+    // replies dropped until the client sends to it again
+    struct socks_udp_peer peers[SOCKS_UDP_PEER_TABLE_SIZE];
+
+    unsigned long datagrams_in, datagrams_out; // received and sent on the relay socket, either way
+    unsigned long bytes_in, bytes_out; // payload relayed from the client, from the destinations
+
+    unsigned char *slots;
+    struct mmsghdr in_msgs[SOCKS_UDP_BATCH];
+    struct iovec in_iov[SOCKS_UDP_BATCH];
+    struct sockaddr_in in_addrs[SOCKS_UDP_BATCH];
+
+    struct mmsghdr out_msgs[SOCKS_UDP_BATCH];
+    struct iovec out_iov[SOCKS_UDP_BATCH];
+    struct sockaddr_in out_addrs[SOCKS_UDP_BATCH];
+    char out_control[SOCKS_UDP_BATCH][CMSG_SPACE(sizeof(unsigned short))];
+};
+
+int socks_udp_open(int client_sockfd, unsigned char *bound);
+struct socks_udp_association *socks_udp_associate(int udp_sockfd, int client_sockfd, const struct socks_request *request);
+int socks_udp_relay(struct socks_udp_association *association, unsigned int max_batches);
+void socks_udp_free(struct socks_udp_association *association);
+
+#endif // SOCKS5_UDP_H
@@ -0,0 +1,185 @@
+// checks the rfc 9112 message framing on fixed byte strings: where a header says its body ends
+// (socks_parse_http_header) and where the body state machine finds the next message (socks_body_consume).
+// a wrong boundary corrupts every message behind it on a keep-alive connection
+// usage: make http_test
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../socks5.h"
+
+static int failures;
+
+static void check(char condition, const char *what) {
+    printf("%s: %s\n", condition ? "ok" : "FAILED", what);
+    if (!condition)
+        ++failures;
+}
+
+// parses a header given as a string, returns the status and sets *content_length
+static int parse(const char *header, ssize_t *content_length) {
+    struct socks_buffer buffer;
+    socks_buffer_init(&buffer, 1 << 20);
+    size_t length = strlen(header);
+    memcpy(socks_buffer_reserve(&buffer, length), header, length);
+    socks_buffer_commit(&buffer, length);
+    *content_length = 12345678;
+    int status = socks_parse_http_header(&buffer, 0, content_length);
+    socks_buffer_free(&buffer);
+    return status;
+}
+
+static char parses_to(const char *header, ssize_t expected) {
+    ssize_t content_length;
+    return parse(header, &content_length) == SOCKS_OK && content_length == expected;
+}
+
+static char rejected(const char *header) {
+    ssize_t content_length;
+    return parse(header, &content_length) == SOCKS_INVALID_HTTP_SYNTAX;
+}
+
+// feeds a body to the state machine step bytes at a time, returns the bytes it took or an error
+static ssize_t consume(ssize_t content_length, const char *data, size_t n, size_t step, unsigned char *mode) {
+    struct socks_body_state body;
+    socks_body_init(&body, content_length);
+    size_t taken = 0;
+    while (taken < n && body.mode != SOCKS_BODY_NONE) {
+        size_t piece = n - taken < step ? n - taken : step;
+        ssize_t status = socks_body_consume(&body, data + taken, piece);
+        if (status < 0)
+            return status;
+        taken += status;
+    }
+    *mode = body.mode;
+    return taken;
+}
+
+// splits a stream of messages the way the relay does: header up to the empty line, then its body.
+// lines receives the first line of every message, head_count leading entries answer HEAD requests.
+// returns the number of messages or -1 when a boundary was off
+static int split(const char *stream, char (*lines)[64], unsigned int max_messages, unsigned int head_count) {
+    size_t length = strlen(stream), offset = 0;
+    unsigned int count = 0;
+    while (offset < length) {
+        const char *end = strstr(stream + offset, "\r\n\r\n");
+        if (end == NULL || count == max_messages)
+            return -1;
+        size_t header_length = end + 4 - (stream + offset);
+
+        char header[4096];
+        memcpy(header, stream + offset, header_length);
+        header[header_length] = 0;
+        ssize_t content_length;
+        if (parse(header, &content_length) != SOCKS_OK)
+            return -1;
+        // the caller's part: a response to HEAD has no body whatever its header says
+        if (count < head_count)
+            content_length = 0;
+
+        size_t line_length = strstr(header, "\r\n") - header;
+        if (line_length >= sizeof(lines[count]))
+            line_length = sizeof(lines[count]) - 1;
+        memcpy(lines[count], header, line_length);
+        lines[count][line_length] = 0;
+        ++count;
+
+        offset += header_length;
+        unsigned char mode;
+        ssize_t taken = consume(content_length, stream + offset, length - offset, 7, &mode);
+        if (taken < 0 || mode != SOCKS_BODY_NONE)
+            return -1;
+        offset += taken;
+    }
+    return count;
+}
+
+int main(void) {
+    ssize_t content_length;
+
+    // requests
+    check(parses_to("GET / HTTP/1.1\r\nHost: x\r\n\r\n", 0), "request without a body");
+    check(parses_to("POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\n", 5), "request with content-length");
+    check(parses_to("POST / HTTP/1.1\r\ncontent-length:   7  \r\n\r\n", 7), "field names are case insensitive, values trimmed");
+    check(parses_to("POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\n", 5), "repeated equal content-length");
+    check(parses_to("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", SOCKS_LENGTH_CHUNKED), "chunked request");
+    check(parses_to("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 9\r\n\r\n", SOCKS_LENGTH_CHUNKED),
+            "transfer-encoding overrides content-length");
+    check(rejected("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n"), "request with a final coding other than chunked");
+    check(rejected("POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n"), "conflicting content-length");
+    check(rejected("POST / HTTP/1.1\r\nContent-Length: 5x\r\n\r\n"), "content-length that isn't a number");
+    check(rejected("POST / HTTP/1.1\r\nContent-Length: \r\n\r\n"), "empty content-length");
+    check(rejected("POST / HTTP/1.1\r\nContent-Length : 5\r\n\r\n"), "whitespace before the colon");
+    check(rejected("POST / HTTP/1.1\r\nX-A: 1\r\n folded\r\n\r\n"), "obsolete line folding");
+    check(parse("POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n", &content_length)
+            == SOCKS_INVALID_HTTP_SYNTAX, "content-length overflow");
+
+    // responses
+    check(parses_to("HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\n", 3), "response with content-length");
+    check(parses_to("HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, chunked\r\n\r\n", SOCKS_LENGTH_CHUNKED), "chunked as the final coding");
+    check(parses_to("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked, gzip\r\n\r\n", SOCKS_LENGTH_UNTIL_CLOSE),
+            "response with a final coding other than chunked is delimited by close");
+    check(parses_to("HTTP/1.0 200 OK\r\nServer: x\r\n\r\n", SOCKS_LENGTH_UNTIL_CLOSE), "response without framing is delimited by close");
+    check(parses_to("HTTP/1.1 100 Continue\r\n\r\n", 0), "100 has no body");
+    check(parses_to("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n\r\n", 0), "101 has no body");
+    check(parses_to("HTTP/1.1 103 Early Hints\r\nLink: </a>\r\n\r\n", 0), "103 has no body");
+    check(parses_to("HTTP/1.1 204 No Content\r\nContent-Length: 99\r\n\r\n", 0), "204 has no body whatever content-length says");
+    check(parses_to("HTTP/1.1 304 Not Modified\r\nContent-Length: 99\r\n\r\n", 0), "304 has no body whatever content-length says");
+    // NOTE: only the relay knows the response answers a HEAD, it drops the length itself
+    check(parses_to("HTTP/1.1 200 OK\r\nContent-Length: 12345\r\n\r\n", 12345), "response to HEAD is left to the caller");
+    check(rejected("HTTP/1.1 20 OK\r\n\r\n"), "malformed status code");
+
+    // bodies, fed whole and a byte at a time
+    const char *chunked = "5;ext=1\r\nhello\r\n10\r\n0123456789abcdef\r\n0\r\nX-Trailer: 1\r\n\r\nGET /next HTTP/1.1\r\n\r\n";
+    ssize_t chunked_length = strstr(chunked, "GET /next") - chunked;
+    unsigned char mode;
+    check(consume(SOCKS_LENGTH_CHUNKED, chunked, strlen(chunked), strlen(chunked), &mode) == chunked_length
+            && mode == SOCKS_BODY_NONE, "chunked body ends before the next message");
+    check(consume(SOCKS_LENGTH_CHUNKED, chunked, strlen(chunked), 1, &mode) == chunked_length
+            && mode == SOCKS_BODY_NONE, "chunked body split at every byte");
+    check(consume(SOCKS_LENGTH_CHUNKED, "5\r\nhelloX\r\n", 11, 11, &mode) == SOCKS_INVALID_HTTP_SYNTAX, "chunk longer than its size");
+    check(consume(SOCKS_LENGTH_CHUNKED, "z\r\n", 3, 3, &mode) == SOCKS_INVALID_HTTP_SYNTAX, "chunk size that isn't hex");
+    check(consume(SOCKS_LENGTH_CHUNKED, "ffffffffffffffffff\r\n", 20, 20, &mode) == SOCKS_INVALID_HTTP_SYNTAX, "chunk size overflow");
+    check(consume(5, "helloGET /", 10, 3, &mode) == 5 && mode == SOCKS_BODY_NONE, "content-length body ends before the next message");
+    check(consume(SOCKS_LENGTH_UNTIL_CLOSE, "all of it", 9, 4, &mode) == 9 && mode == SOCKS_BODY_UNTIL_CLOSE,
+            "body delimited by close takes everything");
+
+    // a full pipeline of requests, then the responses to it, each split where the relay would split them
+    check(SOCKS_PIPELINE_DEPTH == 16, "pipeline depth");
+    char stream[8192] = "", expected[SOCKS_PIPELINE_DEPTH][64], lines[SOCKS_PIPELINE_DEPTH + 1][64];
+    for (unsigned int i = 0; i < SOCKS_PIPELINE_DEPTH; ++i) {
+        char message[256];
+        if (i % 3 == 0)
+            sprintf(message, "POST /p%u HTTP/1.1\r\nContent-Length: %u\r\n\r\n%.*s", i, i, (int)i, "0123456789abcdef");
+        else if (i % 3 == 1)
+            sprintf(message, "POST /p%u HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n", i);
+        else
+            sprintf(message, "GET /p%u HTTP/1.1\r\nHost: x\r\n\r\n", i);
+        strcat(stream, message);
+        sprintf(expected[i], "%s /p%u HTTP/1.1", i % 3 == 2 ? "GET" : "POST", i);
+    }
+    int count = split(stream, lines, SOCKS_PIPELINE_DEPTH + 1, 0);
+    char in_order = count == SOCKS_PIPELINE_DEPTH;
+    for (int i = 0; in_order && i < count; ++i)
+        in_order = strcmp(lines[i], expected[i]) == 0;
+    check(in_order, "16 pipelined requests split at their boundaries");
+
+    // the answer to a HEAD with its length, interim responses, bodiless statuses and bodies of every kind
+    const char *responses =
+        "HTTP/1.1 200 OK\r\nContent-Length: 12345\r\n\r\n"
+        "HTTP/1.1 100 Continue\r\n\r\n"
+        "HTTP/1.1 200 OK\r\nContent-Length: 4\r\n\r\nbody"
+        "HTTP/1.1 204 No Content\r\nContent-Length: 4\r\n\r\n"
+        "HTTP/1.1 304 Not Modified\r\nContent-Length: 4\r\n\r\n"
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n4\r\nbody\r\n0\r\n\r\n"
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    const char *statuses[] = {"HTTP/1.1 200 OK", "HTTP/1.1 100 Continue", "HTTP/1.1 200 OK", "HTTP/1.1 204 No Content",
+        "HTTP/1.1 304 Not Modified", "HTTP/1.1 200 OK", "HTTP/1.1 404 Not Found"};
+    count = split(responses, lines, SOCKS_PIPELINE_DEPTH + 1, 1);
+    in_order = count == 7;
+    for (int i = 0; in_order && i < count; ++i)
+        in_order = strcmp(lines[i], statuses[i]) == 0;
+    check(in_order, "pipelined responses split at their boundaries");
+
+    return failures != 0;
+}
@@ -0,0 +1,157 @@
+// checks the rfc 1928 udp encapsulation round trip through a running proxy:
+// a local echo stub answers every datagram, the driver associates with the proxy and sends to the stub
+// usage: udp_roundtrip [proxy port] [datagrams]
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define SOCKS_PORT 9050
+
+static int failures;
+
+static void check(char condition, const char *what) {
+    printf("%s: %s\n", condition ? "ok" : "FAILED", what);
+    if (!condition)
+        ++failures;
+}
+
+static void *echo_stub(void *arg) {
+    int sockfd = *(int*)arg;
+    unsigned char buf[65536];
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t from_length = sizeof(from);
+        ssize_t length = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_length);
+        if (length == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("recvfrom failed");
+            exit(1);
+        }
+        sendto(sockfd, buf, length, 0, (struct sockaddr*)&from, from_length);
+    }
+    return NULL;
+}
+
+static void exchange(int sockfd, const void *message, size_t length, unsigned char *reply, size_t reply_length) {
+    if (send(sockfd, message, length, 0) != (ssize_t)length || recv(sockfd, reply, reply_length, MSG_WAITALL) != (ssize_t)reply_length) {
+        perror("socks handshake failed");
+        exit(1);
+    }
+}
+
+// sends header + payload to the relay, returns the length of the reply or -1 when none came
+static ssize_t roundtrip(int sockfd, const struct sockaddr_in *relay, const unsigned char *header, size_t header_length,
+        const char *payload, unsigned char *reply, size_t reply_size) {
+    unsigned char datagram[1024];
+    memcpy(datagram, header, header_length);
+    memcpy(datagram + header_length, payload, strlen(payload));
+    sendto(sockfd, datagram, header_length + strlen(payload), 0, (struct sockaddr*)relay, sizeof(*relay));
+    return recv(sockfd, reply, reply_size, 0);
+}
+
+int main(int argc, char **argv) {
+    unsigned short proxy_port = argc > 1 ? atoi(argv[1]) : SOCKS_PORT;
+    unsigned int datagrams = argc > 2 ? atoi(argv[2]) : 1000;
+
+    struct sockaddr_in echo_addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t echo_length = sizeof(echo_addr);
+    int echo_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (echo_sockfd == -1 || bind(echo_sockfd, (struct sockaddr*)&echo_addr, sizeof(echo_addr)) == -1
+            || getsockname(echo_sockfd, (struct sockaddr*)&echo_addr, &echo_length) == -1) {
+        perror("echo stub failed");
+        exit(1);
+    }
+    pthread_t echo_thread;
+    pthread_create(&echo_thread, NULL, echo_stub, &echo_sockfd);
+
+    // UDP ASSOCIATE with DST.ADDR/DST.PORT 0, the proxy learns our port from the first datagram
+    struct sockaddr_in proxy = {.sin_family = AF_INET, .sin_port = htons(proxy_port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int control_sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(control_sockfd, (struct sockaddr*)&proxy, sizeof(proxy)) == -1) {
+        perror("connect failed");
+        exit(1);
+    }
+    unsigned char reply[1024];
+    exchange(control_sockfd, "\x05\x01\x00", 3, reply, 2);
+    check(reply[0] == 5 && reply[1] == 0, "greeting");
+    exchange(control_sockfd, "\x05\x03\x00\x01\x00\x00\x00\x00\x00\x00", 10, reply, 10);
+    check(reply[1] == 0 && reply[3] == 1, "udp associate");
+
+    struct sockaddr_in relay = {.sin_family = AF_INET};
+    memcpy(&relay.sin_addr, reply + 4, sizeof(struct in_addr));
+    memcpy(&relay.sin_port, reply + 8, sizeof(unsigned short));
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct timeval timeout = {.tv_sec = 1};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // the reply header names the echo stub as the source
+    unsigned char header[10] = {0, 0, 0, 1};
+    memcpy(header + 4, &echo_addr.sin_addr, sizeof(struct in_addr));
+    memcpy(header + 8, &echo_addr.sin_port, sizeof(unsigned short));
+
+    ssize_t length = roundtrip(sockfd, &relay, header, sizeof(header), "hello", reply, sizeof(reply));
+    check(length == 15 && memcmp(reply, header, 10) == 0 && memcmp(reply + 10, "hello", 5) == 0, "ipv4 round trip");
+
+    // a host the client never sent to can't inject into the association
+    int stranger_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    sendto(stranger_sockfd, "injected", 8, 0, (struct sockaddr*)&relay, sizeof(relay));
+    close(stranger_sockfd);
+    check(recv(sockfd, reply, sizeof(reply), 0) == -1, "reply from a stranger dropped");
+
+    unsigned char domain_header[5 + 9 + 2] = {0, 0, 0, 3, 9, 'l', 'o', 'c', 'a', 'l', 'h', 'o', 's', 't'};
+    memcpy(domain_header + 14, &echo_addr.sin_port, sizeof(unsigned short));
+    length = roundtrip(sockfd, &relay, domain_header, sizeof(domain_header), "domain", reply, sizeof(reply));
+    check(length == 16 && memcmp(reply, header, 10) == 0 && memcmp(reply + 10, "domain", 6) == 0, "domainname round trip");
+    // the second one comes from the resolve cache
+    length = roundtrip(sockfd, &relay, domain_header, sizeof(domain_header), "cached", reply, sizeof(reply));
+    check(length == 16 && memcmp(reply + 10, "cached", 6) == 0, "domainname round trip (cached)");
+
+    unsigned char fragment_header[10];
+    memcpy(fragment_header, header, sizeof(header));
+    fragment_header[2] = 1;
+    length = roundtrip(sockfd, &relay, fragment_header, sizeof(fragment_header), "fragment", reply, sizeof(reply));
+    check(length == -1, "fragment dropped");
+
+    // .invalid never resolves (rfc 6761), the failure is cached and the datagram dropped
+    unsigned char invalid_header[5 + 15 + 2] = {0, 0, 0, 3, 15};
+    memcpy(invalid_header + 5, "no-such.invalid", 15);
+    memcpy(invalid_header + 20, &echo_addr.sin_port, sizeof(unsigned short));
+    length = roundtrip(sockfd, &relay, invalid_header, sizeof(invalid_header), "unresolvable", reply, sizeof(reply));
+    check(length == -1, "unresolvable host dropped");
+
+    // a window of datagrams in flight, every one has to come back intact
+    unsigned int received = 0, intact = 0;
+    struct timeval started, finished;
+    gettimeofday(&started, NULL);
+    for (unsigned int sent = 0; received < datagrams;) {
+        for (; sent < datagrams && sent - received < 64; ++sent) {
+            unsigned char datagram[10 + sizeof(unsigned int)];
+            memcpy(datagram, header, sizeof(header));
+            memcpy(datagram + 10, &sent, sizeof(sent));
+            sendto(sockfd, datagram, sizeof(datagram), 0, (struct sockaddr*)&relay, sizeof(relay));
+        }
+        length = recv(sockfd, reply, sizeof(reply), 0);
+        if (length == -1)
+            break;
+        ++received;
+        intact += length == 10 + sizeof(unsigned int) && memcmp(reply, header, 10) == 0;
+    }
+    gettimeofday(&finished, NULL);
+    double seconds = finished.tv_sec - started.tv_sec + (finished.tv_usec - started.tv_usec) / 1e6;
+    printf("%u/%u datagrams back in %.3fs (%.0f/s)\n", received, datagrams, seconds, received / seconds);
+    // udp may drop under load, but what comes back must be well formed
+    check(received > 0 && intact == received, "burst round trip");
+
+    close(sockfd);
+    close(control_sockfd);
+    return failures != 0;
+}
@@ -0,0 +1,688 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+#include "log.h"
+#include "socks5.h"
+#include "trace.h"
+
+// a generated leaf certificate, most recently used first
+struct tls_leaf {
+    char host[256];
+    X509 *cert;
+    EVP_PKEY *key;
+    struct tls_leaf *newer, *older;
+    struct tls_leaf *next; // in its bucket
+};
+
+// the last session a destination gave us
+struct tls_session_entry {
+    char host[256];
+    unsigned short port;
+    SSL_SESSION *session;
+};
+
+// plaintext on its way between an ssl object and a socketpair
+struct tls_pending {
+    char data[TLS_PUMP_BUFFER_SIZE];
+    size_t offset, length;
+};
+
+// index 0 is the client side, 1 the destination side
+struct tls_pump {
+    int sockfd[2];
+    int plain[2]; // the pump's ends of the socketpairs, the flow relays the other ends
+    SSL *ssl[2];
+    char closed[2]; // the peer ended its tls session
+    char finished[2]; // the flow closed its end of the socketpair
+    struct tls_pending decrypted[2]; // read from ssl, to be sent to plain
+    struct tls_pending encrypting[2]; // read from plain, to be written to ssl
+
+    char host[256]; // the client's SNI, otherwise the socks request's host
+    unsigned short port;
+    struct tls_flow_info info; // info.host is not valid in the thread
+};
+
+static char tls_is_enabled = 0;
+static char tls_verify = 1;
+static SSL_CTX *tls_server_ctx = NULL; // towards clients
+static SSL_CTX *tls_client_ctx = NULL; // towards destinations
+static X509 *tls_ca_cert = NULL;
+static STACK_OF(X509) *tls_chain = NULL; // sent along with every leaf
+static EVP_PKEY *tls_ca_key = NULL;
+static atomic_uint tls_pump_count = 0;
+static unsigned int tls_max_pumps;
+static int tls_pump_index = -1; // ex data index of the pump on its ssl objects
+
+// NOTE: leaves are shared between the pump threads, a leaf that is evicted while a handshake still uses it
+// lives on through the reference of the ssl object
+static pthread_mutex_t tls_leaf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tls_leaf **tls_leaf_buckets = NULL;
+static unsigned int tls_leaf_mask;
+static struct tls_leaf *tls_newest = NULL, *tls_oldest = NULL;
+static unsigned int tls_leaf_count = 0, tls_leaf_capacity;
+
+// key pairs are generated ahead by their own thread, so a new leaf only has to be signed
+static pthread_mutex_t tls_key_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tls_key_wanted = PTHREAD_COND_INITIALIZER;
+static EVP_PKEY **tls_key_pool = NULL;
+static unsigned int tls_key_count = 0, tls_key_capacity = 0;
+static char tls_key_stopping = 0;
+static pthread_t tls_key_thread;
+
+static pthread_mutex_t tls_session_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tls_session_entry tls_sessions[TLS_SESSION_CACHE_SIZE];
+
+// NOTE: ec keys, generating and signing with them is a fraction of the cost of rsa
+static EVP_PKEY *tls_generate_key(void) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    if (key == NULL) {
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+    return key;
+}
+
+static void *tls_key_generator(void *arg) {
+    pthread_mutex_lock(&tls_key_lock);
+    while (!tls_key_stopping) {
+        if (tls_key_count == tls_key_capacity) {
+            pthread_cond_wait(&tls_key_wanted, &tls_key_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&tls_key_lock);
+        EVP_PKEY *key = tls_generate_key();
+        pthread_mutex_lock(&tls_key_lock);
+        tls_key_pool[tls_key_count++] = key;
+    }
+    pthread_mutex_unlock(&tls_key_lock);
+    return NULL;
+}
+
+static EVP_PKEY *tls_take_key(void) {
+    EVP_PKEY *key = NULL;
+    pthread_mutex_lock(&tls_key_lock);
+    if (tls_key_count > 0)
+        key = tls_key_pool[--tls_key_count];
+    pthread_cond_signal(&tls_key_wanted);
+    pthread_mutex_unlock(&tls_key_lock);
+    // the pool ran dry, the handshake waits for a key of its own
+    return key != NULL ? key : tls_generate_key();
+}
+
+// hosts end up in the subject alt name config string, anything but a plain name or address is refused
+static char tls_valid_host(const char *host) {
+    if (*host == 0 || strlen(host) > 253)
+        return 0;
+    for (const char *i = host; *i != 0; ++i) {
+        char c = *i;
+        if (!(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') && !(c >= '0' && c <= '9') && c != '-' && c != '.' && c != '_')
+            return 0;
+    }
+    return 1;
+}
+
+static char tls_add_extension(X509 *cert, X509V3_CTX *ctx, int nid, const char *value) {
+    X509_EXTENSION *extension = X509V3_EXT_conf_nid(NULL, ctx, nid, value);
+    if (extension == NULL)
+        return 0;
+    char added = X509_add_ext(cert, extension, -1);
+    X509_EXTENSION_free(extension);
+    return added;
+}
+
+// a leaf for host signed by the ca, NULL on failure
+static X509 *tls_make_leaf(const char *host, EVP_PKEY *key) {
+    struct in_addr ip;
+    char is_ip = inet_pton(AF_INET, host, &ip) == 1;
+
+    X509 *cert = X509_new();
+    BIGNUM *serial = BN_new();
+    char alt_name[300];
+    snprintf(alt_name, sizeof(alt_name), "%s:%s", is_ip ? "IP" : "DNS", host);
+
+    X509V3_CTX ctx;
+    X509V3_set_ctx(&ctx, tls_ca_cert, cert, NULL, NULL, 0);
+    char ok = X509_set_version(cert, 2)
+        && BN_rand(serial, 64, BN_RAND_TOP_ANY, BN_RAND_BOTTOM_ANY)
+        && BN_to_ASN1_INTEGER(serial, X509_get_serialNumber(cert)) != NULL
+        // a day back for clients with a clock behind ours
+        && X509_gmtime_adj(X509_getm_notBefore(cert), -86400) != NULL
+        && X509_gmtime_adj(X509_getm_notAfter(cert), 365 * 86400L) != NULL
+        && X509_set_pubkey(cert, key)
+        && X509_set_issuer_name(cert, X509_get_subject_name(tls_ca_cert))
+        // the common name is limited to 64 characters, clients only look at the alt name anyway
+        && (strlen(host) > 64 || X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                (const unsigned char*)host, -1, -1, 0))
+        && tls_add_extension(cert, &ctx, NID_basic_constraints, "critical,CA:FALSE")
+        && tls_add_extension(cert, &ctx, NID_key_usage, "critical,digitalSignature")
+        && tls_add_extension(cert, &ctx, NID_ext_key_usage, "serverAuth")
+        && tls_add_extension(cert, &ctx, NID_subject_key_identifier, "hash")
+        && tls_add_extension(cert, &ctx, NID_authority_key_identifier, "keyid")
+        && tls_add_extension(cert, &ctx, NID_subject_alt_name, alt_name)
+        && X509_sign(cert, tls_ca_key, EVP_sha256()) != 0;
+    BN_free(serial);
+    if (!ok) {
+        X509_free(cert);
+        return NULL;
+    }
+    return cert;
+}
+
+static struct tls_leaf **tls_leaf_slot(const char *host) {
+    struct tls_leaf **slot = &tls_leaf_buckets[socks_hash_host(host, 0) & tls_leaf_mask];
+    while (*slot != NULL && strcmp((*slot)->host, host) != 0)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+static void tls_leaf_unlink(struct tls_leaf *leaf) {
+    if (leaf->newer != NULL)
+        leaf->newer->older = leaf->older;
+    else
+        tls_newest = leaf->older;
+    if (leaf->older != NULL)
+        leaf->older->newer = leaf->newer;
+    else
+        tls_oldest = leaf->newer;
+}
+
+static void tls_leaf_push(struct tls_leaf *leaf) {
+    leaf->newer = NULL;
+    leaf->older = tls_newest;
+    if (tls_newest != NULL)
+        tls_newest->newer = leaf;
+    tls_newest = leaf;
+    if (tls_oldest == NULL)
+        tls_oldest = leaf;
+}
+
+// looks the leaf up under the lock, the caller gets its own references to cert and key
+static char tls_leaf_get(const char *host, X509 **cert, EVP_PKEY **key) {
+    struct tls_leaf *leaf = *tls_leaf_slot(host);
+    if (leaf == NULL)
+        return 0;
+    tls_leaf_unlink(leaf);
+    tls_leaf_push(leaf);
+    X509_up_ref(leaf->cert);
+    EVP_PKEY_up_ref(leaf->key);
+    *cert = leaf->cert;
+    *key = leaf->key;
+    return 1;
+}
+
+// returns 0 when no leaf could be made for host
+static char tls_leaf_for(const char *host, X509 **cert, EVP_PKEY **key) {
+    pthread_mutex_lock(&tls_leaf_lock);
+    char found = tls_leaf_get(host, cert, key);
+    pthread_mutex_unlock(&tls_leaf_lock);
+    if (found)
+        return 1;
+
+    // NOTE: signed outside of the lock, when two handshakes race for the same host the first leaf is kept
+    EVP_PKEY *new_key = tls_take_key();
+    X509 *new_cert = tls_make_leaf(host, new_key);
+    if (new_cert == NULL) {
+        EVP_PKEY_free(new_key);
+        return 0;
+    }
+
+    pthread_mutex_lock(&tls_leaf_lock);
+    if (tls_leaf_get(host, cert, key)) {
+        pthread_mutex_unlock(&tls_leaf_lock);
+        X509_free(new_cert);
+        EVP_PKEY_free(new_key);
+        return 1;
+    }
+    struct tls_leaf *leaf;
+    if (tls_leaf_count == tls_leaf_capacity) {
+        // reuse the least recently used one
+        leaf = tls_oldest;
+        tls_leaf_unlink(leaf);
+        *tls_leaf_slot(leaf->host) = leaf->next;
+        X509_free(leaf->cert);
+        EVP_PKEY_free(leaf->key);
+    } else {
+        leaf = malloc(sizeof(struct tls_leaf));
+        ++tls_leaf_count;
+    }
+    strcpy(leaf->host, host);
+    leaf->cert = new_cert;
+    leaf->key = new_key;
+    struct tls_leaf **slot = tls_leaf_slot(host);
+    leaf->next = NULL;
+    *slot = leaf;
+    tls_leaf_push(leaf);
+    X509_up_ref(new_cert);
+    EVP_PKEY_up_ref(new_key);
+    *cert = new_cert;
+    *key = new_key;
+    pthread_mutex_unlock(&tls_leaf_lock);
+    return 1;
+}
+
+// picks the leaf once the client hello is in, the client's SNI decides which host it's for
+static int tls_select_certificate(SSL *ssl, void *arg) {
+    struct tls_pump *pump = SSL_get_ex_data(ssl, tls_pump_index);
+    const char *server_name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (server_name != NULL && tls_valid_host(server_name))
+        strcpy(pump->host, server_name);
+    if (!tls_valid_host(pump->host))
+        return 0;
+
+    struct trace_span span;
+    trace_begin(&span, "leaf certificate");
+    X509 *cert;
+    EVP_PKEY *key;
+    char found = tls_leaf_for(pump->host, &cert, &key);
+    trace_end(&span);
+    if (!found)
+        return 0;
+
+    int status = SSL_use_cert_and_key(ssl, cert, key, tls_chain, 1);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return status == 1;
+}
+
+// the flow is relayed as http/1.1, clients that would rather speak h2 are told no
+static int tls_select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_length,
+        const unsigned char *in, unsigned int in_length, void *arg) {
+    static const unsigned char http1[] = "\x08http/1.1";
+    unsigned char *selected;
+    if (SSL_select_next_proto(&selected, out_length, http1, sizeof(http1) - 1, in, in_length) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// remembers the session a destination handed out, the next flow to it resumes instead of a full handshake
+static int tls_new_session(SSL *ssl, SSL_SESSION *session) {
+    struct tls_pump *pump = SSL_get_ex_data(ssl, tls_pump_index);
+    struct tls_session_entry *entry = &tls_sessions[socks_hash_host(pump->host, pump->port) & (TLS_SESSION_CACHE_SIZE - 1)];
+
+    pthread_mutex_lock(&tls_session_lock);
+    SSL_SESSION *old = entry->session;
+    strcpy(entry->host, pump->host);
+    entry->port = pump->port;
+    entry->session = session;
+    pthread_mutex_unlock(&tls_session_lock);
+    if (old != NULL)
+        SSL_SESSION_free(old);
+    return 1; // the entry holds the reference now
+}
+
+static SSL_SESSION *tls_cached_session(const char *host, unsigned short port) {
+    struct tls_session_entry *entry = &tls_sessions[socks_hash_host(host, port) & (TLS_SESSION_CACHE_SIZE - 1)];
+    SSL_SESSION *session = NULL;
+    pthread_mutex_lock(&tls_session_lock);
+    if (entry->session != NULL && entry->port == port && strcmp(entry->host, host) == 0
+            && SSL_SESSION_is_resumable(entry->session)) {
+        session = entry->session;
+        SSL_SESSION_up_ref(session);
+    }
+    pthread_mutex_unlock(&tls_session_lock);
+    return session;
+}
+
+static int tls_handshake(SSL *ssl, int sockfd, int timeout, char server) {
+    struct pollfd pollfds[1];
+    pollfds[0].fd = sockfd;
+    while (1) {
+        ERR_clear_error();
+        int status = server ? SSL_accept(ssl) : SSL_connect(ssl);
+        if (status == 1)
+            return SOCKS_OK;
+
+        int error = SSL_get_error(ssl, status);
+        if (error == SSL_ERROR_WANT_READ)
+            pollfds[0].events = POLLIN;
+        else if (error == SSL_ERROR_WANT_WRITE)
+            pollfds[0].events = POLLOUT;
+        else
+            return SOCKS_TLS_FAILED;
+
+        int poll_status = poll(pollfds, 1, timeout);
+        if (poll_status == -1 && errno != EINTR)
+            return SOCKS_CONNECTION_TERMINATED;
+        if (poll_status == 0)
+            return SOCKS_TIMEOUT;
+    }
+}
+
+// moves what is ready between one side's ssl object and its socketpair, sets the events to wait for otherwise
+static int tls_pump_side(struct tls_pump *pump, unsigned int side, struct pollfd *pollfds, char *progress) {
+    SSL *ssl = pump->ssl[side];
+    struct tls_pending *in = &pump->decrypted[side], *out = &pump->encrypting[side];
+
+    if (!pump->closed[side] && !pump->finished[side] && in->length == 0) {
+        ERR_clear_error();
+        int n = SSL_read(ssl, in->data, sizeof(in->data));
+        if (n > 0) {
+            in->offset = 0;
+            in->length = n;
+            *progress = 1;
+        } else {
+            int error = SSL_get_error(ssl, n);
+            if (error == SSL_ERROR_WANT_READ)
+                pollfds[side].events |= POLLIN;
+            else if (error == SSL_ERROR_WANT_WRITE)
+                pollfds[side].events |= POLLOUT;
+            else {
+                // the flow sees the end of the stream, and closes itself once it read the rest
+                pump->closed[side] = 1;
+                shutdown(pump->plain[side], SHUT_WR);
+                *progress = 1;
+            }
+        }
+    }
+    if (in->length > 0 && !pump->finished[side]) {
+        ssize_t n = send(pump->plain[side], in->data + in->offset, in->length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            in->offset += n;
+            in->length -= n;
+            *progress = 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            pollfds[2 + side].events |= POLLOUT;
+        else if (errno != EINTR)
+            return SOCKS_CONNECTION_TERMINATED;
+    }
+
+    if (out->length == 0 && !pump->finished[side]) {
+        ssize_t n = recv(pump->plain[side], out->data, sizeof(out->data), MSG_DONTWAIT);
+        if (n > 0) {
+            out->offset = 0;
+            out->length = n;
+            *progress = 1;
+        } else if (n == 0) {
+            // the flow was closed, what it sent before still goes out
+            pump->finished[side] = 1;
+            *progress = 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            pollfds[2 + side].events |= POLLIN;
+        else if (errno != EINTR)
+            return SOCKS_CONNECTION_TERMINATED;
+    }
+    if (out->length > 0 && pump->closed[side]) {
+        // nobody to send it to, the flow mustn't block on a full socketpair until it notices
+        out->length = 0;
+        *progress = 1;
+    } else if (out->length > 0) {
+        ERR_clear_error();
+        int n = SSL_write(ssl, out->data + out->offset, out->length);
+        if (n > 0) {
+            out->offset += n;
+            out->length -= n;
+            *progress = 1;
+        } else {
+            int error = SSL_get_error(ssl, n);
+            if (error == SSL_ERROR_WANT_READ)
+                pollfds[side].events |= POLLIN;
+            else if (error == SSL_ERROR_WANT_WRITE)
+                pollfds[side].events |= POLLOUT;
+            else
+                return SOCKS_CONNECTION_TERMINATED;
+        }
+    }
+    return SOCKS_OK;
+}
+
+static void tls_pump_relay(struct tls_pump *pump) {
+    // the real sockets first, then the socketpairs
+    struct pollfd pollfds[4];
+    while (1) {
+        char progress;
+        do {
+            progress = 0;
+            for (unsigned int i = 0; i < 2; ++i) {
+                pollfds[i] = (struct pollfd){.fd = pump->sockfd[i], .events = 0, .revents = 0};
+                pollfds[2 + i] = (struct pollfd){.fd = pump->plain[i], .events = 0, .revents = 0};
+            }
+            for (unsigned int side = 0; side < 2; ++side) {
+                if (tls_pump_side(pump, side, pollfds, &progress) < 0)
+                    return;
+            }
+        } while (progress);
+
+        // done once the flow closed both ends and everything it sent before is out
+        if (pump->finished[0] && pump->finished[1]
+                && pump->encrypting[0].length == 0 && pump->encrypting[1].length == 0)
+            return;
+
+        // what nothing waits for isn't polled, a hangup would only wake us up over and over
+        for (unsigned int i = 0; i < 4; ++i) {
+            if (pollfds[i].events == 0)
+                pollfds[i].fd = -1;
+        }
+        if (poll(pollfds, 4, -1) == -1 && errno != EINTR) {
+            // ends this flow only, the loop sees both socketpairs close
+            log_event(LOG_IO_FAILED, errno, pump->info.flow_id, &pump->info.client_addr, &pump->info.dest_addr, 0, 0);
+            return;
+        }
+    }
+}
+
+static void tls_pump_free(struct tls_pump *pump) {
+    for (unsigned int i = 0; i < 2; ++i) {
+        if (pump->ssl[i] != NULL) {
+            // best effort, the socket is non blocking. a session that wasn't shut down isn't resumed
+            if (SSL_is_init_finished(pump->ssl[i]))
+                SSL_shutdown(pump->ssl[i]);
+            SSL_free(pump->ssl[i]);
+        }
+        close(pump->sockfd[i]);
+        close(pump->plain[i]);
+    }
+    free(pump);
+    atomic_fetch_sub(&tls_pump_count, 1);
+}
+
+static void *tls_pump_run(void *arg) {
+    struct tls_pump *pump = arg;
+    trace_flow(pump->info.flow_id, pump->info.traced);
+
+    struct trace_span span;
+    trace_begin(&span, "tls client handshake");
+    int status = tls_handshake(pump->ssl[0], pump->sockfd[0], pump->info.timeout, 1);
+    trace_end(&span);
+
+    if (status == SOCKS_OK) {
+        // the destination is asked for the name the client asked us for
+        SSL *ssl = pump->ssl[1];
+        struct in_addr ip;
+        char is_ip = inet_pton(AF_INET, pump->host, &ip) == 1;
+        if (!is_ip)
+            SSL_set_tlsext_host_name(ssl, pump->host);
+        // an address has to be in the certificate's ip SANs, a name in its dns names
+        if (tls_verify && is_ip)
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), pump->host);
+        else if (tls_verify)
+            SSL_set1_host(ssl, pump->host);
+        SSL_SESSION *session = tls_cached_session(pump->host, pump->port);
+        if (session != NULL) {
+            SSL_set_session(ssl, session);
+            SSL_SESSION_free(session);
+        }
+
+        trace_begin(&span, "tls destination handshake");
+        status = tls_handshake(ssl, pump->sockfd[1], pump->info.timeout, 0);
+        trace_end(&span);
+    }
+
+    if (status < 0)
+        log_event(LOG_TLS_FAILED, status, pump->info.flow_id, &pump->info.client_addr, &pump->info.dest_addr, 0, 0);
+    else
+        tls_pump_relay(pump);
+    tls_pump_free(pump);
+    return NULL;
+}
+
+// terminates the tls session the client is starting on client_sockfd and opens one of our own to the
+// destination. plain is set to the flow's new client and destination sockets, which carry the plaintext.
+// the pump thread owns client_sockfd and dest_sockfd from here on, also when the handshakes fail later
+int tls_intercept(int client_sockfd, int dest_sockfd, const struct tls_flow_info *info, int *plain) {
+    // every pump is a thread, past the limit the flow is turned away like a client past max_connections
+    if (atomic_fetch_add(&tls_pump_count, 1) >= tls_max_pumps) {
+        atomic_fetch_sub(&tls_pump_count, 1);
+        return SOCKS_OVERLOADED;
+    }
+
+    int pairs[2][2];
+    for (unsigned int i = 0; i < 2; ++i) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) == 0)
+            continue;
+        int error = errno;
+        if (i == 1) {
+            close(pairs[0][0]);
+            close(pairs[0][1]);
+        }
+        atomic_fetch_sub(&tls_pump_count, 1);
+        if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM)
+            return SOCKS_OVERLOADED;
+        perror("socketpair failed");
+        exit(1);
+    }
+
+    struct tls_pump *pump = calloc(1, sizeof(struct tls_pump));
+    pump->info = *info;
+    pump->info.host = NULL;
+    strcpy(pump->host, info->host);
+    pump->port = ntohs(info->dest_addr.sin_port);
+    pump->sockfd[0] = client_sockfd;
+    pump->sockfd[1] = dest_sockfd;
+    pump->ssl[0] = SSL_new(tls_server_ctx);
+    pump->ssl[1] = SSL_new(tls_client_ctx);
+    for (unsigned int i = 0; i < 2; ++i) {
+        pump->plain[i] = pairs[i][0];
+        plain[i] = pairs[i][1];
+        fcntl(pump->sockfd[i], F_SETFL, fcntl(pump->sockfd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(pump->plain[i], F_SETFL, fcntl(pump->plain[i], F_GETFL) | O_NONBLOCK);
+        SSL_set_fd(pump->ssl[i], pump->sockfd[i]);
+        SSL_set_ex_data(pump->ssl[i], tls_pump_index, pump);
+    }
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int status = pthread_create(&thread, &attributes, tls_pump_run, pump);
+    pthread_attr_destroy(&attributes);
+    if (status != 0) {
+        // out of threads: the flow keeps its sockets and is closed by the caller
+        for (unsigned int i = 0; i < 2; ++i) {
+            SSL_free(pump->ssl[i]);
+            close(pairs[i][0]);
+            close(pairs[i][1]);
+        }
+        free(pump);
+        atomic_fetch_sub(&tls_pump_count, 1);
+        return SOCKS_OVERLOADED;
+    }
+    return SOCKS_OK;
+}
+
+static void tls_fail(const char *what, const char *path) {
+    fprintf(stderr, "tls: %s %s\n", what, path);
+    ERR_print_errors_fp(stderr);
+    exit(1);
+}
+
+// loads the ca that signs the leaves, a ca_cert_path of "none" leaves interception off.
+// cert_cache_size leaves are kept, key_pool_size keys are generated ahead, max_pumps flows are terminated at once
+void tls_start(const char *ca_cert_path, const char *ca_key_path, unsigned int cert_cache_size,
+        unsigned int key_pool_size, unsigned int max_pumps, char verify) {
+    if (strcmp(ca_cert_path, "none") == 0)
+        return;
+
+    FILE *stream = fopen(ca_cert_path, "r");
+    if (stream == NULL || (tls_ca_cert = PEM_read_X509(stream, NULL, NULL, NULL)) == NULL)
+        tls_fail("could not load the ca certificate from", ca_cert_path);
+    fclose(stream);
+    stream = fopen(ca_key_path, "r");
+    if (stream == NULL || (tls_ca_key = PEM_read_PrivateKey(stream, NULL, NULL, NULL)) == NULL)
+        tls_fail("could not load the ca key from", ca_key_path);
+    fclose(stream);
+    if (X509_check_private_key(tls_ca_cert, tls_ca_key) != 1)
+        tls_fail("the ca key does not belong to", ca_cert_path);
+    tls_verify = verify;
+    tls_max_pumps = max_pumps;
+
+    tls_pump_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    tls_server_ctx = SSL_CTX_new(TLS_server_method());
+    tls_client_ctx = SSL_CTX_new(TLS_client_method());
+    if (tls_server_ctx == NULL || tls_client_ctx == NULL)
+        tls_fail("could not create a context", "");
+    long mode = SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS;
+    SSL_CTX_set_mode(tls_server_ctx, mode);
+    SSL_CTX_set_mode(tls_client_ctx, mode);
+    SSL_CTX_set_min_proto_version(tls_server_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_min_proto_version(tls_client_ctx, TLS1_2_VERSION);
+    // plenty of peers just close the connection, http's own framing tells whether a message was cut short
+    SSL_CTX_set_options(tls_server_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_options(tls_client_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    // clients resume through tickets (the ticket keys belong to the context) and the server side session cache
+    SSL_CTX_set_session_id_context(tls_server_ctx, (const unsigned char*)"interceptor", sizeof("interceptor") - 1);
+    SSL_CTX_set_cert_cb(tls_server_ctx, tls_select_certificate, NULL);
+    SSL_CTX_set_alpn_select_cb(tls_server_ctx, tls_select_protocol, NULL);
+    tls_chain = sk_X509_new_null();
+    sk_X509_push(tls_chain, tls_ca_cert);
+
+    SSL_CTX_set_session_cache_mode(tls_client_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_client_ctx, tls_new_session);
+    SSL_CTX_set_alpn_protos(tls_client_ctx, (const unsigned char*)"\x08http/1.1", 9);
+    if (verify) {
+        SSL_CTX_set_verify(tls_client_ctx, SSL_VERIFY_PEER, NULL);
+        SSL_CTX_set_default_verify_paths(tls_client_ctx);
+    }
+
+    tls_leaf_capacity = cert_cache_size > 0 ? cert_cache_size : 1;
+    unsigned int buckets = 1;
+    while (buckets < tls_leaf_capacity)
+        buckets <<= 1;
+    tls_leaf_buckets = calloc(buckets, sizeof(struct tls_leaf*));
+    tls_leaf_mask = buckets - 1;
+
+    tls_key_capacity = key_pool_size;
+    if (key_pool_size > 0) {
+        tls_key_pool = malloc(key_pool_size * sizeof(EVP_PKEY*));
+        int status = pthread_create(&tls_key_thread, NULL, tls_key_generator, NULL);
+        if (status != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(status));
+            exit(1);
+        }
+    }
+    tls_is_enabled = 1;
+}
+
+// NOTE: running pump threads are left alone, they end with their flows or with the process
+void tls_stop(void) {
+    if (!tls_is_enabled || tls_key_capacity == 0)
+        return;
+    pthread_mutex_lock(&tls_key_lock);
+    tls_key_stopping = 1;
+    pthread_cond_signal(&tls_key_wanted);
+    pthread_mutex_unlock(&tls_key_lock);
+    pthread_join(tls_key_thread, NULL);
+}
+
+char tls_enabled(void) {
+    return tls_is_enabled;
+}
+
+// pump threads still relaying a flow
+unsigned int tls_active(void) {
+    return atomic_load(&tls_pump_count);
+}
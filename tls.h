@@ -0,0 +1,28 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <netinet/in.h>
+
+// destinations whose last session is kept for resumption, a power of two
+#define TLS_SESSION_CACHE_SIZE 1024
+// plaintext moved per read/write in the pump threads
+#define TLS_PUMP_BUFFER_SIZE 16384
+
+// what the pump thread of an intercepted flow needs to know about it
+struct tls_flow_info {
+    unsigned long flow_id;
+    char traced;
+    struct sockaddr_in client_addr;
+    struct sockaddr_in dest_addr;
+    const char *host; // of the socks request, stands in for a missing SNI
+    int timeout; // ms per handshake step
+};
+
+void tls_start(const char *ca_cert_path, const char *ca_key_path, unsigned int cert_cache_size,
+        unsigned int key_pool_size, unsigned int max_pumps, char verify);
+void tls_stop(void);
+char tls_enabled(void);
+unsigned int tls_active(void);
+int tls_intercept(int client_sockfd, int dest_sockfd, const struct tls_flow_info *info, int *plain);
+
+#endif // TLS_H
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "ring.h"
+
+static __thread unsigned long trace_thread_flow = 0;
+static __thread char trace_thread_sampled = 0;
+
+static FILE *trace_stream = NULL;
+static struct ring_set trace_set;
+static char trace_enabled = 0;
+static pid_t trace_pid;
+
+// whether to trace a flow, one in sample_rate flows is (0 traces none)
+char trace_sample(unsigned long flow_id, unsigned int sample_rate) {
+    return trace_enabled && sample_rate != 0 && flow_id % sample_rate == 0;
+}
+
+// spans started on this thread belong to flow_id until the next call
+void trace_flow(unsigned long flow_id, char sampled) {
+    trace_thread_flow = flow_id;
+    trace_thread_sampled = sampled;
+}
+
+void trace_begin(struct trace_span *span, const char *name) {
+    if (!trace_thread_sampled) {
+        span->name = NULL;
+        return;
+    }
+    span->name = name;
+    span->flow_id = trace_thread_flow;
+    clock_gettime(CLOCK_MONOTONIC, &span->start);
+}
+
+// NOTE: spans may also be filled in by hand, e.g. for a phase that outlived a loop iteration
+void trace_end(struct trace_span *span) {
+    if (span->name == NULL)
+        return;
+
+    struct ring *ring;
+    struct trace_record *record = ring_reserve(&trace_set, &ring);
+    if (record == NULL)
+        return;
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    record->name = span->name;
+    record->flow_id = span->flow_id;
+    record->start = span->start;
+    record->duration = (end.tv_sec - span->start.tv_sec) * 1000000000L + end.tv_nsec - span->start.tv_nsec;
+
+    ring_commit(ring);
+}
+
+// chrome trace event format, every flow gets its own track
+static void trace_format(const void *data) {
+    const struct trace_record *record = data;
+    double start = record->start.tv_sec * 1e6 + record->start.tv_nsec / 1e3;
+    fprintf(trace_stream, ",\n{\"name\":\"%s\",\"cat\":\"flow\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%lu}",
+            record->name, start, record->duration / 1e3, trace_pid, record->flow_id);
+}
+
+// shows up as a global instant event in the viewer
+static void trace_dropped(unsigned long count) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(trace_stream, ",\n{\"name\":\"dropped %lu spans (ring full)\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":%d,\"tid\":0}",
+            count, now.tv_sec * 1e6 + now.tv_nsec / 1e3, trace_pid);
+}
+
+// every process writes <prefix>.<pid>.json, so a successor after SIGUSR2 doesn't clobber its predecessor's
+// trace. prefix "none" leaves tracing off
+void trace_start(const char *prefix) {
+    if (strcmp(prefix, "none") == 0)
+        return;
+
+    trace_pid = getpid();
+    char path[512];
+    snprintf(path, sizeof(path), "%s.%d.json", prefix, trace_pid);
+    trace_stream = fopen(path, "w");
+    if (trace_stream == NULL) {
+        perror("trace fopen failed");
+        exit(1);
+    }
+    setvbuf(trace_stream, NULL, _IOFBF, 1 << 16);
+
+    // the array format tolerates a missing ] if the process dies, the viewers load the file either way
+    fprintf(trace_stream, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"interceptor\"}}",
+            trace_pid);
+
+    trace_set.record_size = sizeof(struct trace_record);
+    trace_set.ring_size = TRACE_RING_SIZE;
+    trace_set.flush_interval = TRACE_FLUSH_INTERVAL;
+    trace_set.stream = trace_stream;
+    trace_set.format = trace_format;
+    trace_set.dropped = trace_dropped;
+    ring_start(&trace_set);
+    trace_enabled = 1;
+}
+
+void trace_stop(void) {
+    if (!trace_enabled)
+        return;
+    trace_enabled = 0;
+    ring_stop(&trace_set);
+    fputs("\n]\n", trace_stream);
+    fclose(trace_stream);
+}
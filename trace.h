@@ -0,0 +1,33 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <time.h>
+
+// spans per thread, a power of two
+#define TRACE_RING_SIZE 4096
+// how often the writer thread drains the rings (ms)
+#define TRACE_FLUSH_INTERVAL 250
+
+// NOTE: name points at a string literal, nothing is formatted until the writer thread gets to it
+struct trace_record {
+    const char *name;
+    unsigned long flow_id;
+    struct timespec start;
+    long duration; // ns
+};
+
+// a span of the flow the thread is working on, name is NULL when that flow isn't sampled
+struct trace_span {
+    const char *name;
+    unsigned long flow_id;
+    struct timespec start; // CLOCK_MONOTONIC
+};
+
+void trace_start(const char *path);
+void trace_stop(void);
+char trace_sample(unsigned long flow_id, unsigned int sample_rate);
+void trace_flow(unsigned long flow_id, char sampled);
+void trace_begin(struct trace_span *span, const char *name);
+void trace_end(struct trace_span *span);
+
+#endif // TRACE_H